@@ -22,6 +22,18 @@ extern "C" {
 #define HAL_COMM_PROTO_RAW		0 /* Raw data(User): serial/NRF24 */
 #define HAL_COMM_PROTO_MGMT		1 /* Management: Commands and events */
 
+/*
+ * Multiple adapters: sockets are 16-bit ids. The most significant
+ * 4-bits address the local adapter and the remaining 12-bits address
+ * the logical channel (clients/pipes). The adapter index is the one
+ * of the driver opened by hal_comm_init() (eg: "NRF1" is adapter 1)
+ * and must be OR'ed to the domain of hal_comm_socket(). Sockets of
+ * the adapter 0 are the plain logical channel.
+ */
+#define HAL_COMM_ADAPTER(index)		(((index) & 0x0F) << 12)
+#define HAL_COMM_ADAPTER_INDEX(sockfd)	(((sockfd) >> 12) & 0x0F)
+#define HAL_COMM_CHANNEL(sockfd)	((sockfd) & 0x0FFF)
+
 /*
  * nRF24 and other radios. Returns -ENFILE (limit of resources/pipes has
  * been reached) or an id representing the logical communication channel
@@ -31,6 +43,7 @@ extern "C" {
  */
 
 int hal_comm_init(const char *pathname, const void *params);
+/* Closes all adapters opened by hal_comm_init() */
 int hal_comm_deinit(void);
 
 int hal_comm_socket(int domain, int protocol);
@@ -51,6 +64,19 @@ int hal_comm_accept(int sockfd, void *addr);
 /* Blocking operation. Returns -ETIMEOUT */
 int hal_comm_connect(int sockfd, uint64_t *addr);
 
+/*
+ * Event driven operation: returns a file descriptor signaling adapter
+ * activity (nRF24: IRQ line, watch hal_gpio_poll_events()) or -ENOSYS.
+ * Instead of polling hal_comm_read(), wait on it up to
+ * hal_comm_next_timeout().
+ * Not available if the adapter runs its own thread (NRF24_FLAG_THREAD):
+ * read and write only access the socket queues and never block.
+ */
+int hal_comm_get_fd(int sockfd);
+
+/* Time (ms) until the link layer must run again. -1: no deadline */
+int hal_comm_next_timeout(int sockfd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,6 +32,14 @@ struct gpio_map {
 	uint8_t status:2;
 	int8_t fd_value;
 	int8_t fd_unexport;
+	int fd_edge;		/* Edge events: hal_gpio_get_fd() */
+};
+
+/* Edge read from a hal_gpio_get_fd() file descriptor */
+struct hal_gpio_event {
+	uint8_t gpio;
+	uint8_t edge;			/* HAL_GPIO_RISING or HAL_GPIO_FALLING */
+	uint64_t timestamp_ns;		/* CLOCK_MONOTONIC */
 };
 
 int hal_gpio_setup(void);
@@ -44,6 +52,45 @@ void hal_gpio_analog_reference(uint8_t mode);
 void hal_gpio_analog_write(uint8_t gpio, int value);
 int hal_gpio_get_fd(uint8_t gpio, int edge);
 
+/*
+ * Backend selected at configure time (--with-gpio): sysfs or cdev
+ * (/dev/gpiochip line requests). Pins set up by the same bulk call
+ * share one line request on cdev: a bulk read/write on them is a single
+ * ioctl. On sysfs the bulk functions handle one pin at a time.
+ */
+int hal_gpio_pin_mode_bulk(const uint8_t *gpio, uint8_t count, uint8_t mode);
+int hal_gpio_digital_write_bulk(const uint8_t *gpio, const uint8_t *value,
+								uint8_t count);
+int hal_gpio_digital_read_bulk(const uint8_t *gpio, uint8_t *value,
+								uint8_t count);
+
+/*
+ * Fast path (Raspberry Pi): maps the GPIO registers (path NULL:
+ * /dev/gpiomem), output pins are then written without system call.
+ * Returns 0 or a negative error: writes keep using the backend.
+ */
+int hal_gpio_mmap(const char *path);
+
+/* poll() events signaling edges on hal_gpio_get_fd() descriptors */
+short hal_gpio_poll_events(void);
+
+/* Consumes pending edges: returns how many (0: none) or a negative error */
+int hal_gpio_read_events(int fd, struct hal_gpio_event *events, int count);
+
+/*
+ * Edge events of several pins behind one fd: add it to the main loop
+ * (poll/epoll: POLLIN, GLib: G_IO_IN) and call hal_gpio_event_dispatch()
+ * when readable. Each callback gets the edges of its pin in batches.
+ */
+typedef void (*hal_gpio_event_func)(const struct hal_gpio_event *events,
+						int count, void *user_data);
+
+int hal_gpio_event_add(uint8_t gpio, int edge, hal_gpio_event_func func,
+							void *user_data);
+int hal_gpio_event_remove(uint8_t gpio);
+int hal_gpio_event_get_fd(void);
+int hal_gpio_event_dispatch(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,6 +7,9 @@
  *
  */
 
+#include <stdint.h>
+#include <stddef.h>
+
 void hal_log_init(const char *ident, int detach);
 void hal_log_close(void);
 
@@ -14,3 +17,31 @@ void hal_log_info(const char *format, ...) __attribute__((format(printf, 1, 2)))
 void hal_log_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
 void hal_log_warn(const char *format, ...) __attribute__((format(printf, 1, 2)));
 void hal_log_dbg(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Binary records: the arguments and up to HAL_LOG_PAYLOAD bytes are
+ * copied, the text is built by 'format' (the format id) only when the
+ * record is emitted. Once hal_log_async_start() has been called records
+ * go through a lock-free ring, formatted and written to syslog by a
+ * background thread: logging on the radio path costs a copy. Records
+ * are dropped (and counted) while the ring is full. Otherwise, and for
+ * the printf-like functions above, logging is synchronous.
+ */
+#define HAL_LOG_ERROR		3	/* syslog priorities */
+#define HAL_LOG_WARN		4
+#define HAL_LOG_INFO		6
+#define HAL_LOG_DEBUG		7
+
+#define HAL_LOG_ARGS		4
+#define HAL_LOG_PAYLOAD		32
+
+/* Writes the text of a record (NUL terminated) into buf */
+typedef void (*hal_log_format_func)(char *buf, size_t size,
+				const uint64_t *args, const uint8_t *payload,
+				uint8_t len);
+
+int hal_log_async_start(void);
+void hal_log_async_stop(void);
+void hal_log_record(int level, hal_log_format_func format,
+			const uint64_t *args, uint8_t nargs,
+			const void *payload, size_t len);
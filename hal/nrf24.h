@@ -35,11 +35,24 @@ struct nrf24_mac {
 	} address;
 };
 
+/* nrf24_config flags */
+#define NRF24_FLAG_IRQ		0x01	/* IRQ driven: see hal_comm_get_fd() */
+#define NRF24_FLAG_THREAD	0x02	/* Linux: link layer in its own thread */
+#define NRF24_FLAG_DROP_OLDEST	0x04	/* Rx queue full: drop oldest message */
+#define NRF24_FLAG_VPIPE	0x08	/* Linux: up to 32 peers sharing pipes */
+#define NRF24_FLAG_ACK_PAYLOAD	0x10	/* Gateway data on ACKs, per link */
+#define NRF24_FLAG_LOG_ASYNC	0x20	/* Linux: debug records by a log thread */
+
 struct nrf24_config {
 	struct nrf24_mac mac;
 	uint64_t id;
 	int8_t channel;
 	const char *name;
+	uint8_t flags;
+	uint8_t tx_queue;	/* Linux: messages queued by peer, 0: default */
+	uint8_t rx_queue;	/* Linux: messages received by peer, 0: default */
+	uint16_t presence_window; /* Linux: duplicated presence (ms), 0: default */
+	uint16_t msg_size;	/* Linux: largest message (up to 1920), 0: 128 */
 };
 
 /* Converts nrf24_mac address to string */
@@ -116,6 +129,9 @@ struct mgmt_cmd_nrf24_scan {
  * Synchronous command to manage scanning: beaconing/presence/setup
  * Interval is defined as the elapsed time between the begining of
  * windows. Consequently: window <= interval
+ * Gateway: written to the management socket (hal_comm_write), only
+ * 'filter' is applied. Duplicated presences are the ones received
+ * within nrf24_config presence_window. Default: filter enabled.
  */
 #define MGMT_CMD_NRF24_SCAN_PARAMS		0x0109
 struct mgmt_cmd_nrf24_scan_params {
@@ -126,6 +142,35 @@ struct mgmt_cmd_nrf24_scan_params {
 	uint8_t filter;			/* 0: report all, 1: skip dupplicated */
 } __attribute__ ((packed));
 
+/*
+ * Synchronous command to read the link counters of a connected peer.
+ * Gateway: written to the management socket (hal_comm_write), the next
+ * message read from it is MGMT_CMD_NRF24_RSP: nrf24_link_stats as
+ * payload or status 1 if the peer is not connected.
+ */
+#define MGMT_CMD_NRF24_LINK_STATS		0x010A
+struct mgmt_cmd_nrf24_link_stats {
+	struct nrf24_mac mac;		/* Peer */
+} __attribute__ ((packed));
+
+/* Counters since the link has been established */
+struct nrf24_link_stats {
+	uint32_t tx_frames;		/* Data fragments acknowledged */
+	uint32_t tx_msgs;		/* Messages delivered */
+	uint32_t tx_bytes;		/* Bytes of the messages delivered */
+	uint32_t tx_dropped;		/* Messages given up: no progress */
+	uint32_t tx_retries;		/* Auto retransmissions */
+	uint32_t tx_failed;		/* Not acknowledged (MAX_RT) */
+	uint32_t rx_frames;		/* Packets received: data and control */
+	uint32_t rx_msgs;		/* Messages received */
+	uint32_t rx_bytes;		/* Bytes of the messages received */
+	uint32_t rx_duplicated;		/* Fragments/messages received again */
+	uint32_t rx_errors;		/* Malformed or partial messages */
+	uint32_t rx_dropped;		/* Messages lost: queue or pool full */
+	uint16_t keepalive_missed;	/* Initiator: requests not answered */
+	uint16_t keepalive_rtt;		/* Initiator: last round trip (ms) */
+} __attribute__ ((packed));
+
 /* Sent after detecting activity on data channel: pipe1 to pipe5*/
 #define MGMT_EVT_NRF24_CONNECTED		0x0201 /* PHY connected */
 struct mgmt_evt_nrf24_connected {
@@ -134,6 +179,7 @@ struct mgmt_evt_nrf24_connected {
 
 	uint8_t channel;	/* nRF24 channel: nRF24 spec page 23 */
 	uint8_t aa[5];		/* Access Address: nRF24 spec page 25 */
+	uint8_t opts;		/* Link options offered by the master */
 } __attribute__ ((packed));
 
 /* Sent after timeout or user initiated disconnection */
@@ -14,13 +14,66 @@
 extern "C" {
 #endif
 
+/*
+ * Monotonic time: not affected by wall clock changes. The 32-bit values
+ * wrap (ms: 49 days, us: 71 minutes), hal_timeout() handles it.
+ */
 uint32_t hal_time_ms(void);
 uint32_t hal_time_us(void);
+uint64_t hal_time64_ms(void);
+uint64_t hal_time64_us(void);
 void hal_delay_ms(uint32_t ms);
 void hal_delay_us(uint32_t us);
 int hal_timeout(uint32_t current,  uint32_t start,  uint32_t timeout);
 int hal_getrandom(void *buf, size_t buflen);
 
+/*
+ * Timer wheel: hierarchical, ms resolution (hal_time64_ms). Arming and
+ * cancelling are O(1). Expired timers are called by hal_timer_run(),
+ * hal_timer_next() tells how long the caller may sleep. Timers are
+ * owned by the caller: the wheel only links them. Not thread safe.
+ */
+#ifndef HAL_TIMER_SLOT_BITS
+#ifdef ARDUINO
+#define HAL_TIMER_SLOT_BITS	4
+#else
+#define HAL_TIMER_SLOT_BITS	6
+#endif
+#endif
+#define HAL_TIMER_SLOTS		(1 << HAL_TIMER_SLOT_BITS)
+#define HAL_TIMER_LEVELS	4	/* Longer timeouts are re-armed */
+
+struct hal_timer;
+typedef void (*hal_timer_func)(struct hal_timer *timer, void *user_data);
+
+struct hal_timer {
+	struct hal_timer *next;
+	struct hal_timer **pprev;	/* NULL: not armed */
+	uint64_t expires;		/* ms */
+	uint8_t level;			/* Wheel level: see timer.c */
+	hal_timer_func func;
+	void *user_data;
+};
+
+struct hal_timer_wheel {
+	uint64_t now;			/* Next tick to be run (ms) */
+	uint16_t count[HAL_TIMER_LEVELS];
+	struct hal_timer *slots[HAL_TIMER_LEVELS][HAL_TIMER_SLOTS];
+};
+
+void hal_timer_wheel_init(struct hal_timer_wheel *wheel);
+void hal_timer_init(struct hal_timer *timer, hal_timer_func func,
+							void *user_data);
+/* Re-arming a pending timer moves it: expires ms from now */
+void hal_timer_arm(struct hal_timer_wheel *wheel, struct hal_timer *timer,
+							uint32_t ms);
+void hal_timer_cancel(struct hal_timer_wheel *wheel, struct hal_timer *timer);
+int hal_timer_pending(const struct hal_timer *timer);
+/* Calls the expired timers: returns how many */
+int hal_timer_run(struct hal_timer_wheel *wheel);
+/* Time (ms) until the next timer expires. -1: none armed */
+int hal_timer_next(const struct hal_timer_wheel *wheel);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,7 +23,10 @@
 #include "phy_driver.h"
 
 struct phy_driver *driver_ops[] = {
-	&nrf24l01
+	&nrf24l01,
+#ifndef ARDUINO
+	&nrf24l01_1,
+#endif
 };
 
 /* ARRAY SIZE */
@@ -62,7 +65,7 @@ int phy_open(const char *pathname)
 
 int phy_close(int sockfd)
 {
-	if (sockfd < 0 || sockfd > PHY_DRIVERS_COUNTER)
+	if (sockfd < 0 || sockfd >= PHY_DRIVERS_COUNTER)
 		return -EINVAL;
 
 	/* If has open driver */
@@ -31,6 +31,14 @@ static ssize_t nrf24l01_write(int spi_fd, const void *buffer, size_t len)
 	int err;
 	struct nrf24_io_pack *p = (struct nrf24_io_pack *) buffer;
 
+	/* Streaming: pipe set by NRF24_CMD_STREAM_BEGIN */
+	if (nrf24l01_ptx_streaming(spi_fd)) {
+		if (nrf24l01_ptx_stream_data(spi_fd, p->payload, len) < 0)
+			return -1;
+
+		return len;
+	}
+
 	/* Sets Radio TX mode, enabling Acknowledgment */
 	nrf24l01_set_ptx(spi_fd, p->pipe);
 
@@ -107,8 +115,53 @@ static int nrf24l01_ioctl(int spi_fd, int cmd, void *arg)
 		struct addr_pipe addr;
 		struct channel ch;
 	} param;
+	struct ack_payload *ack;
+	struct retr_pipe *retr;
+	struct observe_pipe *op;
 	int err = -1;
 
+	/*
+	 * TX streaming: CE stays high until NRF24_CMD_STREAM_END, which
+	 * returns how many payloads have been acknowledged.
+	 */
+	if (cmd == NRF24_CMD_STREAM_BEGIN)
+		return nrf24l01_ptx_stream_begin(spi_fd, *((uint8_t *) arg));
+
+	if (cmd == NRF24_CMD_STREAM_END) {
+		err = nrf24l01_ptx_stream_end(spi_fd);
+		nrf24l01_set_prx(spi_fd);
+		return err;
+	}
+
+	/* ACK payloads: loaded while listening, PRX mode is kept */
+	if (cmd == NRF24_CMD_ACK_PAYLOAD) {
+		ack = arg;
+		if (ack->len == 0)
+			return nrf24l01_prx_ack_drop(spi_fd);
+
+		return nrf24l01_prx_ack_data(spi_fd, ack->pipe, ack->payload,
+								ack->len);
+	}
+
+	if (cmd == NRF24_CMD_ACK_PAYLOAD_STATUS)
+		return nrf24l01_prx_ack_status(spi_fd);
+
+	/* Per pipe PTX settings and counters: no register access */
+	if (cmd == NRF24_CMD_SET_RETR) {
+		retr = arg;
+		return nrf24l01_set_retr(spi_fd, retr->pipe, retr->ard,
+								retr->arc);
+	}
+
+	if (cmd == NRF24_CMD_TX_OBSERVE) {
+		op = arg;
+		return nrf24l01_ptx_observe(spi_fd, op->pipe, &op->obs);
+	}
+
+	/* Channel survey: samples carrier while listening, PRX is kept */
+	if (cmd == NRF24_CMD_RPD)
+		return nrf24l01_prx_rpd(spi_fd, *((uint8_t *) arg));
+
 	/* Set standby to set registers */
 	nrf24l01_set_standby(spi_fd);
 
@@ -128,6 +181,14 @@ static int nrf24l01_ioctl(int spi_fd, int cmd, void *arg)
 		break;
 	case NRF24_CMD_SET_STANDBY:
 		break;
+	/* IRQ driven RX: returns the fd to be watched */
+	case NRF24_CMD_SET_IRQ:
+		err = nrf24l01_set_irq(spi_fd);
+		break;
+	/* Sends and receives payloads on ACKs */
+	case NRF24_CMD_SET_ACK_PAYLOAD:
+		err = nrf24l01_set_ack_payload(spi_fd, *((bool *) arg));
+		break;
 	default:
 		break;
 	}
@@ -153,3 +214,18 @@ struct phy_driver nrf24l01 = {
 	.ref_open = 0,
 	.fd = -1
 };
+
+#ifndef ARDUINO
+/* Second radio: SPI0 chip select 1 */
+struct phy_driver nrf24l01_1 = {
+	.name = "NRF1",
+	.pathname = "/dev/spidev0.1",
+	.open = nrf24l01_open,
+	.read = nrf24l01_read,
+	.write = nrf24l01_write,
+	.ioctl = nrf24l01_ioctl,
+	.close = nrf24l01_close,
+	.ref_open = 0,
+	.fd = -1
+};
+#endif
@@ -24,6 +24,35 @@ enum nrf24_cmds {
 				NRF24_CMD_SET_ADDRESS_PIPE,
 				NRF24_CMD_SET_POWER,
 				NRF24_CMD_SET_STANDBY,
+				NRF24_CMD_SET_IRQ,
+				NRF24_CMD_STREAM_BEGIN,
+				NRF24_CMD_STREAM_END,
+				NRF24_CMD_SET_ACK_PAYLOAD,
+				NRF24_CMD_ACK_PAYLOAD,
+				NRF24_CMD_ACK_PAYLOAD_STATUS,
+				NRF24_CMD_SET_RETR,
+				NRF24_CMD_TX_OBSERVE,
+				NRF24_CMD_RPD,
+};
+
+/* Used to set auto retransmission of a pipe (arc 0: default) */
+struct retr_pipe {
+	uint8_t pipe;
+	uint8_t ard;
+	uint8_t arc;
+};
+
+/* Used to read and clear the PTX counters of a pipe */
+struct observe_pipe {
+	uint8_t pipe;
+	struct nrf24_observe obs;
+};
+
+/* Used to load an ACK payload (len 0: drop the loaded one) */
+struct ack_payload {
+	uint8_t pipe;
+	uint8_t len;
+	uint8_t payload[NRF24_PAYLOAD_SIZE];
 };
 
 /* Used to set pipe address */
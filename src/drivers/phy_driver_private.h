@@ -39,3 +39,6 @@ struct phy_driver {
 };
 
 extern struct phy_driver nrf24l01;
+#ifndef ARDUINO
+extern struct phy_driver nrf24l01_1;
+#endif
@@ -17,8 +17,12 @@
 #include "hal/avr_unistd.h"
 #else
 #include "hal/linux_log.h"
+#include "hal/gpio_sysfs.h"
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #endif
 
 #include "hal/nrf24.h"
@@ -28,24 +32,51 @@
 #include "nrf24l01_ll.h"
 #include "phy_driver.h"
 #include "phy_driver_nrf24.h"
-
-/*
- * Transmission time (ms) values for each pipe. Note that every next
- * pipe there's a increase on the trans and retrans time. For more
- * on how these values were calculated, please refer to  nrf24l01 specs
- * or check out this very commit message.
- */
-#define PIPE1_WINDOW 15
-#define PIPE2_WINDOW 18
-#define PIPE3_WINDOW 22
-#define PIPE4_WINDOW 26
-#define PIPE5_WINDOW 30
+#include "ring.h"
 
 #define _MIN(a, b)		((a) < (b) ? (a) : (b))
 #define DATA_SIZE 128
 #define MGMT_SIZE 32
+#define MGMT_RSP_SIZE	(sizeof(struct mgmt_nrf24_header) + \
+			 sizeof(struct mgmt_cmd_nrf24_rsp) + \
+			 sizeof(struct nrf24_link_stats))
 #define MGMT_TIMEOUT 10
-#define RAW_TIMEOUT_DEFAULT 10
+
+/*
+ * Data channel schedule (ms). Without traffic the RAW window lasts
+ * RAW_IDLE_WINDOW and idle peers only exchange keepalives: it must be
+ * longer than MGMT_TIMEOUT, otherwise both ends may alternate in
+ * opposite phases and never meet. The window is kept open RAW_HOLD
+ * after the last fragment sent or received, up to RAW_PEER_WINDOW for
+ * each peer sending or receiving a message. One transmission (fragment
+ * with auto retransmissions) is about 1 to 8 ms.
+ */
+#define RAW_IDLE_WINDOW		20
+#define RAW_HOLD		5
+#define RAW_PEER_WINDOW		15
+
+/*
+ * ACK payload links (NRF24_LL_OPT_ACK_PAYLOAD): the gateway fragments
+ * ride on the ACKs while the peer is transmitting. Silent for ACK_HOLD,
+ * they are written as usual: before the peer leaves the data channel
+ * (RAW_HOLD) and flushes its RX FIFO.
+ */
+#define ACK_HOLD		(RAW_HOLD / 2)
+
+/* Slave: link options not confirmed to the master yet (peer opts) */
+#define OPTS_CONFIRM		0x80
+
+/*
+ * Auto retransmission of each link, see link_adapt(): the delay grows
+ * while packets need retransmissions to get through (interference,
+ * collisions) and the count drops while most of them are lost anyway
+ * (out of range): the ARQ retries later instead of wasting airtime.
+ */
+#define RETR_STEP_MAX		2		/* ARD: 250us steps */
+#define RETR_CUT_MAX		2		/* ARC: 15, 7 or 3 */
+#define RETR_AVG_HIGH		(2 * 16)	/* Retries per packet x16 */
+#define RETR_AVG_LOW		(16 / 2)
+#define RETR_LOSS_HIGH		(16 * 7 / 8)	/* Lost per packet x16 */
 
 #define WINDOW_BCAST		5		/* ms */
 #define INTERVAL_BCAST		60		/* ms */
@@ -53,18 +84,134 @@
 
 #define MAX_RT 3 /* Max write_raw retries */
 
-static uint8_t raw_timeout = RAW_TIMEOUT_DEFAULT;
+/*
+ * Selective repeat ARQ: write_raw() streams the fragments not yet
+ * acknowledged within ARQ_WINDOW of the oldest one, up to ARQ_BURST
+ * each time, back to back (TX FIFO kept full). The receiver drains its
+ * RX FIFO meanwhile: a fragment found full is retransmitted by the
+ * radio. The receiver places fragments by nseq and reports the missing
+ * ones (NACK) once DATA_END arrives.
+ */
+#define ARQ_WINDOW		8
+#define ARQ_BURST		ARQ_WINDOW
+#define ARQ_TIMEOUT		100	/* ms: no progress, message dropped */
+#define ARQ_PARKED_TIMEOUT	1000	/* Acceptor: gateway pipe parked */
+#define NSEQ_NONE		0xFF
+#define FRAG_BIT(nseq)		((uint64_t) 1 << (nseq))
+/* Fragments 0 to last */
+#define FRAG_MASK(last)		(((uint64_t) 2 << (last)) - 1)
+
+/*
+ * Ring slots (power of two) of each socket. Gateway is double buffered:
+ * the engine thread fills a slot while the application reads the other.
+ */
+#ifndef ARDUINO
+#define DATA_SLOTS		2
+#define MGMT_SLOTS		2
+#else
+#define DATA_SLOTS		1
+#define MGMT_SLOTS		1
+#endif
+
+/*
+ * Management events: connect/disconnect are queued apart from presence
+ * and always read first. Presence of a device already queued is
+ * coalesced, and when the presence queue is full the oldest is dropped.
+ */
+#ifndef ARDUINO
+#define MGMT_EVT_SLOTS		8
+#define MGMT_PRESENCE_SLOTS	16
+#else
+#define MGMT_EVT_SLOTS		1
+#define MGMT_PRESENCE_SLOTS	1
+#endif
+
+/*
+ * Transmit and receive queues (messages) of each peer. Fixed on AVR,
+ * on Linux they may be changed by nrf24_config tx_queue and rx_queue
+ * (rounded to a power of two).
+ */
+#ifndef NRF24_TX_QUEUE
+#define NRF24_TX_QUEUE		DATA_SLOTS
+#endif
+#ifndef NRF24_RX_QUEUE
+#define NRF24_RX_QUEUE		DATA_SLOTS
+#endif
+#define QUEUE_MAX		128
+
+/*
+ * Message payloads are chained chunks (one fragment each) taken from
+ * two pools shared by the peers of the adapter: transmission and
+ * reception. Messages are up to nrf24_config msg_size on Linux and
+ * NRF24_MSG_SIZE on AVR, limited by the pool and NRF24_MAX_MSG_SIZE.
+ */
+#define CHUNK_SIZE		30	/* NRF24_PW_MSG_SIZE, for #if */
+#define CHUNK_NONE		0xFF
+#define MSG_CHUNKS(len)		(((len) + CHUNK_SIZE - 1) / CHUNK_SIZE)
+
+#ifndef NRF24_MSG_SIZE
+#define NRF24_MSG_SIZE		DATA_SIZE
+#endif
+
+#ifndef NRF24_POOL_CHUNKS
+#ifndef ARDUINO
+#define NRF24_POOL_CHUNKS	128
+#else
+#define NRF24_POOL_CHUNKS	MSG_CHUNKS(NRF24_MSG_SIZE)
+#endif
+#endif
+
+/* Free chunks ring: power of two */
+#if NRF24_POOL_CHUNKS <= 8
+#define POOL_RING_SLOTS		8
+#elif NRF24_POOL_CHUNKS <= 32
+#define POOL_RING_SLOTS		32
+#elif NRF24_POOL_CHUNKS <= 128
+#define POOL_RING_SLOTS		128
+#else
+#error "NRF24_POOL_CHUNKS: up to 128 chunks"
+#endif
+
+/*
+ * Gateway presence cache: duplicated presences of a device are not
+ * reported within the window (ms, nrf24_config presence_window).
+ * Open addressing table (power of two) with linear probing, the
+ * stalest probed entry is replaced when there is no free one.
+ */
+#ifndef ARDUINO
+#define PRESENCE_CACHE		256
+#define PRESENCE_PROBE		8
+#define PRESENCE_WINDOW		1000
+#endif
+
+/*
+ * Gateway data channel survey: the Received Power Detector is sampled
+ * SURVEY_SAMPLES times on each channel and its busy ratio is smoothed
+ * (0: quiet). Without peers, SURVEY_STEP channels are swept every
+ * SURVEY_INTERVAL (ms) instead of listening to management. The data
+ * channel is picked again before connecting the first peer.
+ */
+#ifndef ARDUINO
+#define SURVEY_CHANNELS		126	/* 2400 to 2525 MHz */
+#define SURVEY_SAMPLES		8
+#define SURVEY_STEP		4
+#define SURVEY_INTERVAL		250
+#define SURVEY_UNUSABLE		UINT8_MAX /* Not allowed at the data rate */
+#endif
 
-/* Retransmission start time and channel offset */
-static uint8_t rt_stamp = 0;
-static uint8_t rt_offset = 0;
+/* Engine thread: radio polling interval (us) if IRQ is not available */
+#define ENGINE_POLL_US		250
 
 #define SET_BIT(val, idx)	((val) |= 1 << (idx))
 #define CLR_BIT(val, idx)	((val) &= ~(1 << (idx)))
 #define CHK_BIT(val, idx)      ((val) & (1 << (idx)))
 
-/* Global to know if listen function was called */
-static uint8_t listen = 0;
+/* Link counters (MGMT_CMD_NRF24_LINK_STATS): gateway only */
+#ifndef ARDUINO
+#define STATS_ADD(peer, field, val)	((peer)->stats.field += (val))
+#else
+#define STATS_ADD(peer, field, val)	do { } while (0)
+#endif
 
 /*
  * Bitmask to track assigned pipes.
@@ -77,67 +224,112 @@ static uint8_t listen = 0;
  * 0010 0000: pipe5
  */
 #define PIPE_RAW_BITMASK	0b00111110 /* Map of RAW Pipes */
+#define PIPE_BITMASK_DEFAULT	0b00000001 /* Scanning/broadcasting */
 
-static uint8_t pipe_bitmask = 0b00000001; /* Default: scanning/broadcasting */
+/* Ring slots: complete messages */
+struct mgmt_msg {
+	size_t len;
+	uint8_t data[MGMT_SIZE];
+};
+
+struct data_msg {
+	size_t len;
+	uint8_t chunk;			/* First chunk */
+};
 
-static struct nrf24_mac mac_local = {.address.uint64 = 0 };
+/*
+ * Free chunks are a ring: the side releasing chunks is the producer
+ * (tx: running(), rx: hal_comm_read()) and the allocating side the
+ * consumer. Chunks not in the ring are owned by a message.
+ */
+struct chunk_pool {
+	struct ring free_ring;
+	uint8_t free[POOL_RING_SLOTS];
+	uint8_t next[NRF24_POOL_CHUNKS];	/* Chain: CHUNK_NONE ends */
+	uint8_t data[NRF24_POOL_CHUNKS][CHUNK_SIZE];
+};
 
-/* Structure to save broadcast context */
+/*
+ * Structure to save broadcast context. The event rings are filled by
+ * running() and consumed by hal_comm_read()/hal_comm_accept(), the
+ * tx ring the other way around.
+ */
 struct nrf24_mgmt {
 	int8_t pipe;
-	uint8_t buffer_rx[MGMT_SIZE];
-	size_t len_rx;
-	uint8_t buffer_tx[MGMT_SIZE];
-	size_t len_tx;
+	struct ring evt_ring;		/* Connect/disconnect */
+	struct mgmt_msg evt[MGMT_EVT_SLOTS];
+	struct ring presence_ring;	/* Overwrite mode */
+	struct mgmt_msg presence[MGMT_PRESENCE_SLOTS];
+	uint16_t evt_dropped;
+	struct ring tx_ring;
+	struct mgmt_msg tx[MGMT_SLOTS];
+#ifndef ARDUINO
+	/* Command response: read before any event, see write_mgmt_cmd() */
+	size_t rsp_len;			/* 0: none */
+	uint8_t rsp[MGMT_RSP_SIZE];
+#endif
 };
 
-static struct nrf24_mgmt mgmt = {.pipe = -1, .len_rx = 0, .len_tx = 0};
+#ifndef ARDUINO
+struct presence_entry {
+	struct nrf24_mac mac;		/* Zero: free entry */
+	uint32_t last_seen;		/* Last presence reported (ms) */
+	uint16_t count;			/* Presences suppressed since then */
+};
+#endif
 
-/* Structure to save peers context */
+/*
+ * Structure to save peers context. The peer index is the socket, its
+ * access address is bound to a data pipe (1 to 5) while the peer is
+ * live: 0 means parked (virtual pipes, see pipes_rotate()) and -1 free.
+ */
 struct nrf24_data {
 	int8_t pipe;
-	uint8_t buffer_rx[DATA_SIZE];
-	size_t len_rx;
-	uint8_t buffer_tx[DATA_SIZE];
-	size_t len_tx;
-	uint8_t seqnumber_tx;
-	uint8_t seqnumber_rx;
-	size_t offset_rx;
+	uint8_t aa[5];			/* Access address */
+	struct ring rx_ring;		/* Slots: see rx_msg() */
+	struct ring tx_ring;		/* Slots: see tx_msg() */
+	uint32_t rx_dropped;		/* Messages lost: rx queue full */
+	uint64_t tx_frags;		/* Fragments acknowledged */
+	uint64_t rx_frags;		/* Fragments received */
+	uint8_t msgid_tx;		/* Oldest message of tx queue */
+	uint8_t msgid_rx;		/* Last message seen */
+	uint8_t rx_state;
+	uint8_t rx_last;		/* DATA_END nseq or NSEQ_NONE */
+	size_t rx_len;
+	uint8_t rx_chunk;		/* Reassembly chain */
+	uint8_t rx_chunks;
 	unsigned long keepalive_anchor; /* Last packet received */
 	uint8_t keepalive; /* zero: disabled or positive: window attempts */
-	uint8_t write_offset; /* Writting offset handler */
 	uint8_t write_rt; /* Writting retry counter */
+	uint32_t write_anchor; /* First write_raw retry */
+	uint8_t opts;		/* Link options in use: NRF24_LL_OPT_* */
+	uint8_t retr_step;	/* ARD added to the pipe default */
+	uint8_t retr_cut;	/* ARC: NRF24_ARC >> retr_cut */
+	uint8_t retr_avg;	/* Retries per packet x16, smoothed */
+	uint8_t retr_loss;	/* Lost per packet x16, smoothed */
 	struct nrf24_mac mac;
+#ifndef ARDUINO
+	struct nrf24_link_stats stats;	/* rx_dropped: see above */
+	uint32_t keepalive_sent;	/* Last request, 0: answered */
+	struct hal_timer link_timer;	/* Keepalive timeout */
+	uint8_t link_lost;		/* link_timer expired */
+#endif
 };
 
-#ifndef ARDUINO	/* If master then 5 peers */
-static struct nrf24_data peers[5] = {
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0,
-		.write_offset = 0, .write_rt = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0,
-		.write_offset = 0, .write_rt = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0,
-		.write_offset = 0, .write_rt = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0,
-		.write_offset = 0, .write_rt = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0,
-		.write_offset = 0, .write_rt = 0},
-	};
-#else	/* If slave then 1 peer */
-static struct nrf24_data peers[1] = {
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0},
+/* Receiver state of msgid_rx */
+enum {
+	RX_NEW,		/* Any msgid starts a message */
+	RX_ACTIVE,	/* Reassembling */
+	RX_SKIP		/* Received or discarded: retransmissions ignored */
 };
-#endif
 
-/* ARRAY SIZE */
-#define CONNECTION_COUNTER	((int) (sizeof(peers) \
-				 / sizeof(peers[0])))
+#ifndef ARDUINO	/* If master then 5 pipes, 32 peers (virtual pipes) */
+#define CONNECTION_COUNTER	32
+#define PIPE_COUNTER		5
+#else	/* If slave then 1 peer */
+#define CONNECTION_COUNTER	1
+#define PIPE_COUNTER		1
+#endif
 
 /*
  * TODO: Get this values from config file
@@ -145,23 +337,6 @@ static struct nrf24_data peers[1] = {
  */
 static uint8_t aa_pipe0[5] = {0x8D, 0xD9, 0xBE, 0x96, 0xDE};
 
-/* Global to save driver index */
-static int driverIndex = -1;
-
-/* Global to save adapter settings */
-static const struct nrf24_config *config;
-
-/*
- * Channel to management and raw data
- *
- * nRF24 channels has been selected to avoid common interference sources:
- * Wi-Fi channels (1, 6 and 11) and Bluetooth adversiting channels (37,
- * 38 and 39). Suggested nRF24 channels are channels 22 (2422 MHz), 50
- * (2450 MHz), 74 (2474 MHz), 76 (2476 MHz) and 97 (2497 MHz).
- */
-static struct channel channel_mgmt = {.value = 76, .ack = false};
-static struct channel channel_raw = {.value = 22, .ack = true};
-
 enum {
 	START_MGMT,
 	MGMT,
@@ -169,8 +344,6 @@ enum {
 	RAW
 };
 
-static int running_state = START_MGMT;
-
 enum {
 	PRESENCE,
 	BURST_WINDOW,
@@ -178,8 +351,98 @@ enum {
 	TIMEOUT_INTERVAL
 };
 
-static uint8_t presence_connect_state = PRESENCE;
-static uint8_t previous_state = TIMEOUT_INTERVAL;
+/*
+ * Structure to save adapter context. Each adapter drives one radio
+ * (phy driver) and its index is the phy driver index.
+ */
+struct nrf24_adapter {
+	int driver;			/* Driver index, -1: not opened */
+	int irq_fd;			/* IRQ driven: watched fd or -1 */
+	const struct nrf24_config *config;	/* Adapter settings */
+	struct nrf24_mac mac_local;
+	struct nrf24_mgmt mgmt;
+	struct nrf24_data peers[CONNECTION_COUNTER];
+	uint8_t tx_slots;		/* Transmit queue of each peer */
+	uint8_t rx_slots;		/* Receive queue of each peer */
+#ifndef ARDUINO
+	struct data_msg *tx_msgs;	/* CONNECTION_COUNTER * tx_slots */
+	struct data_msg *rx_msgs;	/* CONNECTION_COUNTER * rx_slots */
+#else
+	struct data_msg tx_msgs[CONNECTION_COUNTER * NRF24_TX_QUEUE];
+	struct data_msg rx_msgs[CONNECTION_COUNTER * NRF24_RX_QUEUE];
+#endif
+	uint16_t msg_size;		/* Largest message */
+	struct chunk_pool tx_pool;
+	struct chunk_pool rx_pool;
+	uint8_t pipe_bitmask;		/* Assigned pipes */
+	/* Socket bound, 0: none. Pipe 0: ACK payloads (PTX) */
+	uint8_t pipe_peer[PIPE_COUNTER + 1];
+	uint8_t peers_max;		/* Connections allowed */
+	uint8_t listen;			/* Listen function was called */
+	unsigned long raw_activity;	/* Last fragment sent or received */
+	/* Fragment loaded as ACK payload: see write_ack() */
+	uint8_t ack_sockfd;		/* 0: none */
+	uint8_t ack_msgid;
+	uint8_t ack_nseq;
+	/*
+	 * Channel to management and raw data
+	 *
+	 * nRF24 channels has been selected to avoid common interference
+	 * sources: Wi-Fi channels (1, 6 and 11) and Bluetooth adversiting
+	 * channels (37, 38 and 39). Suggested nRF24 channels are channels
+	 * 22 (2422 MHz), 50 (2450 MHz), 74 (2474 MHz), 76 (2476 MHz) and
+	 * 97 (2497 MHz).
+	 */
+	struct channel channel_mgmt;
+	struct channel channel_raw;
+	int running_state;
+	int sock_index;			/* Index peers */
+	unsigned long running_start;
+	uint8_t presence_connect_state;
+	uint8_t previous_state;
+	unsigned long presence_start;
+#ifndef ARDUINO
+	/* Duplicated presence filter: MGMT_CMD_NRF24_SCAN_PARAMS */
+	uint8_t presence_filter;
+	uint16_t presence_window;
+	struct presence_entry presence_cache[PRESENCE_CACHE];
+	uint8_t vpipe_next;		/* Last peer unparked */
+
+	/* Busy ratio of each channel: see survey_step() */
+	uint8_t survey_busy[SURVEY_CHANNELS];
+	uint8_t survey_next;		/* Next channel to be sampled */
+	uint32_t survey_start;		/* Last step */
+
+	/* Link timers of the peers: run by running(), under the lock */
+	struct hal_timer_wheel timers;
+
+	/*
+	 * Engine thread (NRF24_FLAG_THREAD): runs the link layer, the
+	 * application only touches the rings. Control operations (socket,
+	 * accept, close, ...) are serialized by the lock.
+	 */
+	pthread_mutex_t lock;
+	pthread_t engine;
+	int wake_fd;			/* eventfd, -1: no engine thread */
+	uint8_t engine_stop;
+	uint8_t log_async;		/* Log thread started by this adapter */
+#endif
+};
+
+#ifndef ARDUINO	/* Gateway: one adapter for each SPI chip select */
+static struct nrf24_adapter adapters[] = {
+	{ .driver = -1 },
+	{ .driver = -1 },
+};
+#else
+static struct nrf24_adapter adapters[] = {
+	{ .driver = -1 },
+};
+#endif
+
+/* ARRAY SIZE */
+#define ADAPTER_COUNTER		((int) (sizeof(adapters) \
+				 / sizeof(adapters[0])))
 
 #ifdef ARDUINO
 #define DBG_RECV(mac1, mac2, pdu, len)  DBG()
@@ -194,255 +457,819 @@ static void DBG(void)
 #define DBG_RECV(mac1, mac2, pdu, len)  DBG('<', mac1, mac2, pdu, len)
 #define DBG_SEND(mac1, mac2, pdu, len)  DBG('>', mac1, mac2, pdu, len)
 
+/* Log thread (NRF24_FLAG_LOG_ASYNC) or inline: "mac1 dir mac2 pdu" */
+static void dbg_format(char *buf, size_t size, const uint64_t *args,
+				const uint8_t *pdu, uint8_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	struct nrf24_mac mac;
+	char src[24], dst[24];
+	size_t i, n;
+
+	mac.address.uint64 = args[1];
+	nrf24_mac2str(&mac, src);
+	mac.address.uint64 = args[2];
+	nrf24_mac2str(&mac, dst);
+
+	n = snprintf(buf, size, "%s %c %s ", src, (char) args[0], dst);
+	if (n >= size)
+		return;
+
+	for (i = 0; i < len && n + 2 < size; i++) {
+		buf[n++] = hex[pdu[i] >> 4];
+		buf[n++] = hex[pdu[i] & 0x0f];
+	}
+
+	buf[n] = '\0';
+}
+
+/* Radio path: only copies the addresses and the PDU */
 static void DBG(char dir, const struct nrf24_mac *mac,
 			const struct nrf24_mac *peer_mac,
 			const uint8_t *pdu, size_t len)
 {
-	char buffer[128];
-	char *ptr = buffer + 50;
-	size_t i;
+	uint64_t args[3];
 
-	memset(buffer, 0, sizeof(buffer));
+	args[0] = dir;
+	args[1] = mac->address.uint64;
+	args[2] = peer_mac->address.uint64;
 
-	nrf24_mac2str(mac, buffer);
+	hal_log_record(HAL_LOG_DEBUG, dbg_format, args, 3, pdu, len);
+}
+#endif
+
+/* Transmit queue slot of the peer (sockfd: 1 to CONNECTION_COUNTER) */
+static inline struct data_msg *tx_msg(struct nrf24_adapter *adapter,
+						int sockfd, int slot)
+{
+	return &adapter->tx_msgs[(sockfd - 1) * adapter->tx_slots + slot];
+}
 
-	buffer[23] = ' ';
-	buffer[24] = dir;
-	buffer[25] = ' ';
+/* Receive queue slot of the peer */
+static inline struct data_msg *rx_msg(struct nrf24_adapter *adapter,
+						int sockfd, int slot)
+{
+	return &adapter->rx_msgs[(sockfd - 1) * adapter->rx_slots + slot];
+}
 
-	nrf24_mac2str(peer_mac, buffer + 26);
-	buffer[49] = ' ';
+static void pool_init(struct chunk_pool *pool)
+{
+	uint8_t i;
 
-	for (i = 0; i < len && ((i * 2) < sizeof(buffer)); i++) {
-		snprintf(ptr, 3, "%02x", pdu[i]);
-		ptr += 2;
+	ring_init(&pool->free_ring, POOL_RING_SLOTS);
+	for (i = 0; i < NRF24_POOL_CHUNKS; i++) {
+		pool->free[i] = i;
+		ring_commit_write(&pool->free_ring);
 	}
-
-	hal_log_dbg("%s", buffer);
 }
-#endif
 
-/*
- * Calculates data-channel time as a sum of each allocated pipe tr time.
- * This already accounts for startup time, time on air and other delays.
- * For more on this, please refer to nrf24l01 specs or to this commit's
- * log message.
- */
-static uint8_t new_raw_time(void)
+/* Consumer: returns a free chunk or CHUNK_NONE if the pool is empty */
+static uint8_t chunk_alloc(struct chunk_pool *pool)
 {
-	uint8_t new_time = 0;
-
-	if CHK_BIT(pipe_bitmask, 1)
-		new_time+= PIPE1_WINDOW;
-	if CHK_BIT(pipe_bitmask, 2)
-		new_time+= PIPE2_WINDOW;
-	if CHK_BIT(pipe_bitmask, 3)
-		new_time+= PIPE3_WINDOW;
-	if CHK_BIT(pipe_bitmask, 4)
-		new_time+= PIPE4_WINDOW;
-	if CHK_BIT(pipe_bitmask, 5)
-		new_time+= PIPE5_WINDOW;
+	int slot = ring_peek_read(&pool->free_ring);
+	uint8_t chunk;
 
-	rt_offset = new_time/3;
-	if (rt_offset > 20)
-		rt_offset -= 5;
+	if (slot < 0)
+		return CHUNK_NONE;
 
-	if (new_time == 0)
-		new_time = RAW_TIMEOUT_DEFAULT;
+	chunk = pool->free[slot];
+	ring_commit_read(&pool->free_ring);
+	pool->next[chunk] = CHUNK_NONE;
 
-	return new_time;
+	return chunk;
 }
 
-static inline int alloc_pipe(void)
+/* Consumer: chain of count chunks, the caller checks they are free */
+static uint8_t chunk_chain(struct chunk_pool *pool, uint8_t count)
 {
-	uint8_t i;
+	uint8_t head = CHUNK_NONE, chunk;
 
-	for (i = 0; i < CONNECTION_COUNTER; i++) {
-		if (peers[i].pipe == -1) {
-			/* Peers initialization */
-			memset(&peers[i], 0, sizeof(peers[i]));
-			/* One peer for pipe*/
-			peers[i].pipe = i+1;
-			SET_BIT(pipe_bitmask, peers[i].pipe);
-			return peers[i].pipe;
-		}
+	while (count-- > 0) {
+		chunk = chunk_alloc(pool);
+		pool->next[chunk] = head;
+		head = chunk;
 	}
 
-	/* No free pipe */
-	return -1;
+	return head;
 }
 
-static int write_disconnect(int spi_fd, int sockfd, struct nrf24_mac *dst,
-							struct nrf24_mac *src)
+/* Producer: releases the first count chunks of the chain */
+static void chunk_free(struct chunk_pool *pool, uint8_t chunk, uint8_t count)
 {
-	struct nrf24_io_pack p;
-	struct nrf24_ll_data_pdu *opdu;
-	struct nrf24_ll_crtl_pdu *llctrl;
-	struct nrf24_ll_disconnect *lldc;
-	int err, len;
+	uint8_t next;
 
-	memset(&p, 0, sizeof(p));
+	while (chunk < NRF24_POOL_CHUNKS && count-- > 0) {
+		next = pool->next[chunk];
+		pool->free[ring_peek_write(&pool->free_ring)] = chunk;
+		ring_commit_write(&pool->free_ring);
+		chunk = next;
+	}
+}
 
-	p.pipe = sockfd;
+/* Chunk at index of the chain or CHUNK_NONE */
+static uint8_t chunk_at(const struct chunk_pool *pool, uint8_t chunk,
+								uint8_t index)
+{
+	while (chunk < NRF24_POOL_CHUNKS && index-- > 0)
+		chunk = pool->next[chunk];
 
-	opdu = (struct nrf24_ll_data_pdu *) p.payload;
-	llctrl = (struct nrf24_ll_crtl_pdu *) opdu->payload;
-	lldc = (struct nrf24_ll_disconnect *) llctrl->payload;
+	return (chunk < NRF24_POOL_CHUNKS ? chunk : CHUNK_NONE);
+}
 
-	opdu->lid = NRF24_PDU_LID_CONTROL;
-	llctrl->opcode = NRF24_LL_CRTL_OP_DISCONNECT;
-	lldc->dst_addr.address.uint64 = dst->address.uint64;
-	lldc->src_addr.address.uint64 = src->address.uint64;
-	len = sizeof(struct nrf24_ll_data_pdu)
-		+ sizeof(struct nrf24_ll_crtl_pdu)
-		+ sizeof(struct nrf24_ll_disconnect);
+static void chunk_write(struct chunk_pool *pool, uint8_t chunk,
+					const uint8_t *buffer, size_t len)
+{
+	size_t plen;
 
-	DBG_SEND(&mac_local, &peers[sockfd - 1].mac,
-				(const uint8_t *) opdu, len);
+	for (; len > 0; len -= plen, buffer += plen) {
+		plen = _MIN(len, CHUNK_SIZE);
+		memcpy(pool->data[chunk], buffer, plen);
+		chunk = pool->next[chunk];
+	}
+}
 
-	err = phy_write(spi_fd, &p, len);
-	if (err < 0)
-		return err;
+/* Bounded: the chain may be reused while it is read (see drop oldest) */
+static void chunk_read(const struct chunk_pool *pool, uint8_t chunk,
+						uint8_t *buffer, size_t len)
+{
+	size_t plen;
 
-	return 0;
+	for (; len > 0 && chunk < NRF24_POOL_CHUNKS;
+					len -= plen, buffer += plen) {
+		plen = _MIN(len, CHUNK_SIZE);
+		memcpy(buffer, pool->data[chunk], plen);
+		chunk = pool->next[chunk];
+	}
 }
 
-static int write_keepalive(int spi_fd, int sockfd, int keepalive_op,
-				struct nrf24_mac *dst, struct nrf24_mac *src)
+/* Appends count chunks to the reassembly chain of the peer */
+static void rx_chunk_append(struct nrf24_adapter *adapter,
+			struct nrf24_data *peer, uint8_t chunk, uint8_t count)
 {
-	int err, len;
-	/* Assemble keep alive packet */
-	struct nrf24_io_pack p;
-	struct nrf24_ll_data_pdu *opdu;
-	struct nrf24_ll_crtl_pdu *llctrl;
-	struct nrf24_ll_keepalive *llkeepalive;
+	struct chunk_pool *pool = &adapter->rx_pool;
 
-	memset(&p, 0, sizeof(p));
-
-	p.pipe = sockfd;
+	if (peer->rx_chunks == 0)
+		peer->rx_chunk = chunk;
+	else
+		pool->next[chunk_at(pool, peer->rx_chunk,
+					peer->rx_chunks - 1)] = chunk;
 
-	opdu = (struct nrf24_ll_data_pdu *) p.payload;
-	llctrl = (struct nrf24_ll_crtl_pdu *) opdu->payload;
-	llkeepalive = (struct nrf24_ll_keepalive *) llctrl->payload;
+	peer->rx_chunks += count;
+}
 
-	opdu->lid = NRF24_PDU_LID_CONTROL;
-	/* Keep alive opcode - Request or Response */
-	llctrl->opcode = keepalive_op;
-	/* src and dst address to keepalive */
-	llkeepalive->dst_addr.address.uint64 = dst->address.uint64;
-	llkeepalive->src_addr.address.uint64 = src->address.uint64;
-	/* Sends keep alive packet */
-	len = sizeof(*opdu) + sizeof(*llctrl) + sizeof(*llkeepalive);
+/*
+ * Chunk of the fragment nseq: the reassembly chain grows as needed.
+ * Chunks of an unfinished message are kept for the next one.
+ */
+static uint8_t rx_chunk_at(struct nrf24_adapter *adapter,
+				struct nrf24_data *peer, uint8_t nseq)
+{
+	uint8_t chunk;
 
-	DBG_SEND(&mac_local, &peers[sockfd - 1].mac,
-					(const uint8_t *) opdu, len);
+	while (peer->rx_chunks <= nseq) {
+		chunk = chunk_alloc(&adapter->rx_pool);
+		if (chunk == CHUNK_NONE)
+			return CHUNK_NONE;
 
-	err = phy_write(spi_fd, &p, len);
-	if (err < 0)
-		return err;
+		rx_chunk_append(adapter, peer, chunk, 1);
+	}
 
-	return 0;
+	return chunk_at(&adapter->rx_pool, peer->rx_chunk, nseq);
 }
 
-static int check_keepalive(int spi_fd, int sockfd)
+/* Largest message: limited by the link layer and the chunk pool */
+static uint16_t msg_size(uint16_t size)
 {
-	uint32_t time_ms = hal_time_ms();
+	if (size > NRF24_MAX_MSG_SIZE)
+		size = NRF24_MAX_MSG_SIZE;
 
-	/* Check if timeout occurred */
-	if (hal_timeout(time_ms, peers[sockfd-1].keepalive_anchor,
-						NRF24_KEEPALIVE_TIMEOUT_MS) > 0)
-		return -ETIMEDOUT;
+	if (size > NRF24_POOL_CHUNKS * CHUNK_SIZE)
+		size = NRF24_POOL_CHUNKS * CHUNK_SIZE;
 
-	/* Disabled? (Acceptor is always 0) */
-	if (peers[sockfd-1].keepalive == 0)
-		return 0;
+	return size;
+}
 
-	if (hal_timeout(time_ms, peers[sockfd-1].keepalive_anchor,
-		peers[sockfd-1].keepalive * NRF24_KEEPALIVE_SEND_MS) <= 0)
-		return 0;
+/*
+ * Returns to the pools the chunks held by a peer. Queues are emptied
+ * the way their consumer does it: released again, nothing is freed
+ * twice. 'received': the messages not read yet and the one being
+ * reassembled too (rx pool freed by the application side).
+ */
+static void peer_release(struct nrf24_adapter *adapter, int sockfd,
+							bool received)
+{
+	struct nrf24_data *peer = &adapter->peers[sockfd - 1];
+	struct data_msg *msg;
+	uint8_t tail, chunk;
+	uint16_t len;
+	int slot;
+
+	while ((slot = ring_peek_read(&peer->tx_ring)) >= 0) {
+		msg = tx_msg(adapter, sockfd, slot);
+		chunk_free(&adapter->tx_pool, msg->chunk,
+						MSG_CHUNKS(msg->len));
+		ring_commit_read(&peer->tx_ring);
+	}
 
-	peers[sockfd-1].keepalive++;
+	if (!received)
+		return;
 
-	/* Sends keepalive packet */
-	return write_keepalive(spi_fd, sockfd,
-			      NRF24_LL_CRTL_OP_KEEPALIVE_REQ,
-			      &peers[sockfd-1].mac, &mac_local);
+	while ((slot = ring_peek_read_tail(&peer->rx_ring, &tail)) >= 0) {
+		msg = rx_msg(adapter, sockfd, slot);
+		len = msg->len;
+		chunk = msg->chunk;
+
+		/* Dropped meanwhile: freed by the receiver */
+		if (ring_commit_read_tail(&peer->rx_ring, tail))
+			chunk_free(&adapter->rx_pool, chunk, MSG_CHUNKS(len));
+	}
+
+	chunk_free(&adapter->rx_pool, peer->rx_chunk, peer->rx_chunks);
+	peer->rx_chunks = 0;
+	peer->rx_state = RX_NEW;
 }
 
-static int write_mgmt(int spi_fd)
+#ifndef ARDUINO
+/* Keepalive timeout of the peer: check_keepalive() reports it */
+static void link_timeout(struct hal_timer *timer, void *user_data)
 {
-	int err;
-	struct nrf24_io_pack p;
+	struct nrf24_data *peer = user_data;
 
-	/* If nothing to do */
-	if (mgmt.len_tx == 0)
-		return -EAGAIN;
+	peer->link_lost = 1;
+}
+#endif
 
-	/* Set pipe to be sent */
-	p.pipe = 0;
-	/* Copy buffer_tx to payload */
-	memcpy(p.payload, mgmt.buffer_tx, mgmt.len_tx);
+/* Link started or packet received from the peer: timeout restarts */
+static void keepalive_restart(struct nrf24_adapter *adapter,
+						struct nrf24_data *peer)
+{
+	peer->keepalive_anchor = hal_time_ms();
+#ifndef ARDUINO
+	peer->link_lost = 0;
+	hal_timer_arm(&adapter->timers, &peer->link_timer,
+					NRF24_KEEPALIVE_TIMEOUT_MS);
+#endif
+}
 
-	err = phy_write(spi_fd, &p, mgmt.len_tx);
-	if (err < 0)
-		return err;
+/*
+ * Auto retransmission of the peer pipe. Counters of the pipe restart:
+ * the ones left (previous peer or parameters) are discarded.
+ */
+static void link_retr(struct nrf24_adapter *adapter, struct nrf24_data *peer)
+{
+	struct retr_pipe retr;
+	struct observe_pipe op;
 
-	/* Reset len_tx */
-	mgmt.len_tx = 0;
+	retr.pipe = peer->pipe;
+	retr.ard = peer->pipe + 1 + peer->retr_step;
+	retr.arc = NRF24_ARC >> peer->retr_cut;
+	phy_ioctl(adapter->driver, NRF24_CMD_SET_RETR, &retr);
 
-	return err;
+	op.pipe = peer->pipe;
+	phy_ioctl(adapter->driver, NRF24_CMD_TX_OBSERVE, &op);
 }
 
-static int read_mgmt(int spi_fd)
+/*
+ * Link quality of the peer: retransmissions and losses (OBSERVE_TX)
+ * of the packets sent since the last call tune its auto retransmission.
+ */
+static void link_adapt(struct nrf24_adapter *adapter, struct nrf24_data *peer)
 {
-	struct nrf24_io_pack p;
-	struct nrf24_ll_mgmt_pdu *ipdu;
-	struct mgmt_evt_nrf24_bcast_presence *mgmtev_bcast;
-	struct mgmt_evt_nrf24_connected *mgmtev_cn;
-	struct mgmt_nrf24_header *mgmtev_hdr;
-	struct nrf24_ll_mgmt_connect *llc;
-	struct nrf24_ll_presence *llp;
-	ssize_t ilen;
+	struct observe_pipe op;
+	uint8_t step = peer->retr_step, cut = peer->retr_cut;
+	uint16_t packets, avg;
+
+	if (peer->pipe <= 0)
+		return;
+
+	op.pipe = peer->pipe;
+	if (phy_ioctl(adapter->driver, NRF24_CMD_TX_OBSERVE, &op) < 0)
+		return;
+
+	STATS_ADD(peer, tx_retries, op.obs.retries);
+	STATS_ADD(peer, tx_failed, op.obs.lost);
+
+	packets = op.obs.sent + op.obs.lost;
+	if (packets == 0)
+		return;
+
+	/* Peer not heard lately: it may be on the other channel */
+	if (hal_timeout(hal_time_ms(), peer->keepalive_anchor, RAW_HOLD) > 0)
+		return;
+
+	avg = _MIN(op.obs.retries * 16UL / packets, UINT8_MAX);
+	peer->retr_avg = (peer->retr_avg * 3 + avg) / 4;
+	peer->retr_loss = (peer->retr_loss * 3 +
+				op.obs.lost * 16UL / packets) / 4;
+
+	/* Packets lost even after all retries, again and again */
+	if (peer->retr_loss > RETR_LOSS_HIGH && cut < RETR_CUT_MAX)
+		cut++;
+	else if (op.obs.lost == 0 && cut > 0)
+		cut--;
+
+	if (peer->retr_avg > RETR_AVG_HIGH && step < RETR_STEP_MAX)
+		step++;
+	else if (peer->retr_avg < RETR_AVG_LOW && step > 0)
+		step--;
+
+	if (step == peer->retr_step && cut == peer->retr_cut)
+		return;
+
+	peer->retr_step = step;
+	peer->retr_cut = cut;
+	link_retr(adapter, peer);
+}
 
-	/* Read from management pipe */
-	memset(&p, 0, sizeof(p));
+/* Opens a data pipe with the access address of the peer */
+static void pipe_bind(struct nrf24_adapter *adapter, int sockfd, int pipe)
+{
+	struct nrf24_data *peer = &adapter->peers[sockfd - 1];
+	struct addr_pipe ap;
 
-	ipdu = (struct nrf24_ll_mgmt_pdu *)p.payload;
-	/* Read data */
-	ilen = phy_read(spi_fd, &p, NRF24_MTU);
-	if (ilen <= 0)
-		return -EAGAIN;
+	ap.pipe = pipe;
+	memcpy(ap.aa, peer->aa, sizeof(ap.aa));
+	phy_ioctl(adapter->driver, NRF24_CMD_SET_PIPE, &ap);
 
-	/* If already has something in rx buffer then return BUSY */
-	if (mgmt.len_rx != 0)
-		return -EBUSY;
+	peer->pipe = pipe;
+	adapter->pipe_peer[pipe] = sockfd;
+	SET_BIT(adapter->pipe_bitmask, pipe);
 
-	/* Event header structure */
-	mgmtev_hdr = (struct mgmt_nrf24_header *) mgmt.buffer_rx;
+	link_retr(adapter, peer);
+}
 
-	switch (ipdu->type) {
-	/* If is a presente type */
-	case NRF24_PDU_TYPE_PRESENCE:
+/* Closes the data pipe of the peer (if any): the peer is parked */
+static void pipe_unbind(struct nrf24_adapter *adapter, struct nrf24_data *peer)
+{
+	struct ack_payload ack;
+	int pipe = peer->pipe;
+
+	if (pipe <= 0)
+		return;
+
+	/* Fragment waiting on the ACKs of this pipe */
+	if (adapter->ack_sockfd == adapter->pipe_peer[pipe]) {
+		ack.pipe = pipe;
+		ack.len = 0;
+		phy_ioctl(adapter->driver, NRF24_CMD_ACK_PAYLOAD, &ack);
+		adapter->ack_sockfd = 0;
+	}
 
-		/*
-		 * If broadcasting: Ignore presence from other devices.
+	if (adapter->pipe_peer[0] == adapter->pipe_peer[pipe])
+		adapter->pipe_peer[0] = 0;
+
+	phy_ioctl(adapter->driver, NRF24_CMD_RESET_PIPE, &pipe);
+
+	CLR_BIT(adapter->pipe_bitmask, pipe);
+	adapter->pipe_peer[pipe] = 0;
+	peer->pipe = 0;
+}
+
+/* Returns a data pipe not bound to any peer or 0 */
+static int pipe_free(struct nrf24_adapter *adapter)
+{
+	int pipe;
+
+	for (pipe = 1; pipe <= PIPE_COUNTER; pipe++) {
+		if (adapter->pipe_peer[pipe] == 0)
+			return pipe;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocates a peer (socket) using the given access address or, if NULL,
+ * the gateway one: 4 MSB of the MAC address and the socket as LSB. The
+ * peer is parked if all data pipes are in use.
+ */
+static inline int alloc_pipe(struct nrf24_adapter *adapter, const uint8_t *aa)
+{
+	struct nrf24_data *peers = adapter->peers;
+	uint8_t i;
+	int pipe;
+
+	for (i = 0; i < adapter->peers_max; i++) {
+		if (peers[i].pipe == -1) {
+			/* Peers initialization */
+			peer_release(adapter, i + 1, true);
+			memset(&peers[i], 0, sizeof(peers[i]));
+			ring_init(&peers[i].rx_ring, adapter->rx_slots);
+			ring_init(&peers[i].tx_ring, adapter->tx_slots);
+#ifndef ARDUINO
+			hal_timer_init(&peers[i].link_timer, link_timeout,
+								&peers[i]);
+#endif
+
+			if (aa) {
+				memcpy(peers[i].aa, aa, sizeof(peers[i].aa));
+			} else {
+				memcpy(peers[i].aa,
+					&adapter->mac_local.address.b[3],
+					sizeof(peers[i].aa));
+				peers[i].aa[0] = i + 1;
+			}
+
+			pipe = pipe_free(adapter);
+			if (pipe > 0)
+				pipe_bind(adapter, i + 1, pipe);
+
+			return i + 1;
+		}
+	}
+
+	/* No free pipe */
+	return -1;
+}
+
+/* All connections allowed are in use: no room for a new peer */
+static bool peers_full(struct nrf24_adapter *adapter)
+{
+	uint8_t i;
+
+	for (i = 0; i < adapter->peers_max; i++) {
+		if (adapter->peers[i].pipe == -1)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the next free connect/disconnect event or NULL if the
+ * queue is full (the event is lost and accounted).
+ */
+static struct mgmt_nrf24_header *mgmt_evt_get(struct nrf24_adapter *adapter)
+{
+	int slot = ring_peek_write(&adapter->mgmt.evt_ring);
+
+	if (slot < 0) {
+		adapter->mgmt.evt_dropped++;
+		return NULL;
+	}
+
+	return (struct mgmt_nrf24_header *) adapter->mgmt.evt[slot].data;
+}
+
+/* Publishes the event returned by mgmt_evt_get() */
+static void mgmt_evt_commit(struct nrf24_adapter *adapter, size_t len)
+{
+	struct nrf24_mgmt *mgmt = &adapter->mgmt;
+
+	mgmt->evt[ring_peek_write(&mgmt->evt_ring)].len = len;
+	ring_commit_write(&mgmt->evt_ring);
+}
+
+/*
+ * Returns the slot for a presence of 'mac' or NULL if this device has
+ * a presence pending. If the queue is full the oldest one is dropped.
+ */
+static struct mgmt_nrf24_header *mgmt_presence_get(
+					struct nrf24_adapter *adapter,
+					const struct nrf24_mac *mac)
+{
+	struct nrf24_mgmt *mgmt = &adapter->mgmt;
+	struct mgmt_evt_nrf24_bcast_presence *mgmtev_bcast;
+	struct mgmt_nrf24_header *mgmtev_hdr;
+	uint8_t idx;
+	int slot;
+
+	/* Slots contents are only written by this side: safe to scan */
+	for (idx = RING_LOAD(&mgmt->presence_ring.tail);
+			idx != mgmt->presence_ring.head; idx++) {
+		mgmtev_hdr = (struct mgmt_nrf24_header *)
+			mgmt->presence[idx & mgmt->presence_ring.mask].data;
+		mgmtev_bcast = (struct mgmt_evt_nrf24_bcast_presence *)
+							mgmtev_hdr->payload;
+		if (mgmtev_bcast->mac.address.uint64 == mac->address.uint64)
+			return NULL;
+	}
+
+	slot = ring_peek_write(&mgmt->presence_ring);
+	if (slot < 0) {
+		ring_drop_oldest(&mgmt->presence_ring);
+		slot = ring_peek_write(&mgmt->presence_ring);
+	}
+
+	return (struct mgmt_nrf24_header *) mgmt->presence[slot].data;
+}
+
+/* Publishes the event returned by mgmt_presence_get() */
+static void mgmt_presence_commit(struct nrf24_adapter *adapter, size_t len)
+{
+	struct nrf24_mgmt *mgmt = &adapter->mgmt;
+
+	mgmt->presence[ring_peek_write(&mgmt->presence_ring)].len = len;
+	ring_commit_write(&mgmt->presence_ring);
+}
+
+#ifndef ARDUINO
+static inline uint8_t presence_hash(const struct nrf24_mac *mac)
+{
+	uint32_t key = (uint32_t) (mac->address.uint64 ^
+					(mac->address.uint64 >> 32));
+
+	/* Fibonacci hashing: spread sequential MACs */
+	return (key * 2654435761u) >> 24;
+}
+
+/* Returns true if 'mac' has been reported within the filter window */
+static bool presence_duplicated(struct nrf24_adapter *adapter,
+					const struct nrf24_mac *mac)
+{
+	struct presence_entry *entry, *victim = NULL;
+	uint32_t now = hal_time_ms();
+	uint8_t i, idx;
+
+	if (!adapter->presence_filter)
+		return false;
+
+	idx = presence_hash(mac);
+	for (i = 0; i < PRESENCE_PROBE; i++, idx++) {
+		entry = &adapter->presence_cache[idx & (PRESENCE_CACHE - 1)];
+
+		if (entry->mac.address.uint64 == mac->address.uint64) {
+			if (!hal_timeout(now, entry->last_seen,
+						adapter->presence_window)) {
+				if (entry->count < UINT16_MAX)
+					entry->count++;
+				return true;
+			}
+
+			victim = entry;
+			break;
+		}
+
+		/* Entries are never freed: not found if a free one is hit */
+		if (entry->mac.address.uint64 == 0) {
+			victim = entry;
+			break;
+		}
+
+		/* Otherwise the stalest one is replaced */
+		if (victim == NULL ||
+			now - entry->last_seen > now - victim->last_seen)
+			victim = entry;
+	}
+
+	victim->mac.address.uint64 = mac->address.uint64;
+	victim->last_seen = now;
+	victim->count = 0;
+
+	return false;
+}
+#else
+#define presence_duplicated(adapter, mac)	false
+#endif
+
+static int write_disconnect(struct nrf24_adapter *adapter, int sockfd,
+				struct nrf24_mac *dst, struct nrf24_mac *src)
+{
+	struct nrf24_io_pack p;
+	struct nrf24_ll_data_pdu *opdu;
+	struct nrf24_ll_crtl_pdu *llctrl;
+	struct nrf24_ll_disconnect *lldc;
+	int err, len;
+
+	memset(&p, 0, sizeof(p));
+
+	p.pipe = adapter->peers[sockfd - 1].pipe;
+
+	opdu = (struct nrf24_ll_data_pdu *) p.payload;
+	llctrl = (struct nrf24_ll_crtl_pdu *) opdu->payload;
+	lldc = (struct nrf24_ll_disconnect *) llctrl->payload;
+
+	opdu->lid = NRF24_PDU_LID_CONTROL;
+	llctrl->opcode = NRF24_LL_CRTL_OP_DISCONNECT;
+	lldc->dst_addr.address.uint64 = dst->address.uint64;
+	lldc->src_addr.address.uint64 = src->address.uint64;
+	len = sizeof(struct nrf24_ll_data_pdu)
+		+ sizeof(struct nrf24_ll_crtl_pdu)
+		+ sizeof(struct nrf24_ll_disconnect);
+
+	DBG_SEND(&adapter->mac_local, &adapter->peers[sockfd - 1].mac,
+				(const uint8_t *) opdu, len);
+
+	err = phy_write(adapter->driver, &p, len);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+static int write_keepalive(struct nrf24_adapter *adapter, int sockfd,
+				int keepalive_op, struct nrf24_mac *dst,
+				struct nrf24_mac *src)
+{
+	int err, len;
+	/* Assemble keep alive packet */
+	struct nrf24_io_pack p;
+	struct nrf24_ll_data_pdu *opdu;
+	struct nrf24_ll_crtl_pdu *llctrl;
+	struct nrf24_ll_keepalive *llkeepalive;
+	uint8_t opts = adapter->peers[sockfd - 1].opts & ~OPTS_CONFIRM;
+
+	memset(&p, 0, sizeof(p));
+
+	p.pipe = adapter->peers[sockfd - 1].pipe;
+
+	opdu = (struct nrf24_ll_data_pdu *) p.payload;
+	llctrl = (struct nrf24_ll_crtl_pdu *) opdu->payload;
+	llkeepalive = (struct nrf24_ll_keepalive *) llctrl->payload;
+
+	opdu->lid = NRF24_PDU_LID_CONTROL;
+	/* Keep alive opcode - Request or Response */
+	llctrl->opcode = keepalive_op;
+	/* src and dst address to keepalive */
+	llkeepalive->dst_addr.address.uint64 = dst->address.uint64;
+	llkeepalive->src_addr.address.uint64 = src->address.uint64;
+	/* Sends keep alive packet */
+	len = sizeof(*opdu) + sizeof(*llctrl) + sizeof(*llkeepalive);
+
+	/* Slave: link options accepted */
+	if (keepalive_op == NRF24_LL_CRTL_OP_KEEPALIVE_RSP && opts) {
+		llkeepalive->opts[0] = opts;
+		len++;
+	}
+
+	DBG_SEND(&adapter->mac_local, &adapter->peers[sockfd - 1].mac,
+					(const uint8_t *) opdu, len);
+
+	err = phy_write(adapter->driver, &p, len);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+static int write_nack(struct nrf24_adapter *adapter, int sockfd,
+					uint8_t msgid, uint64_t missing)
+{
+	struct nrf24_io_pack p;
+	struct nrf24_ll_data_pdu *opdu;
+	struct nrf24_ll_crtl_pdu *llctrl;
+	struct nrf24_ll_nack *llnack;
+	int err, len;
+
+	memset(&p, 0, sizeof(p));
+
+	p.pipe = adapter->peers[sockfd - 1].pipe;
+
+	opdu = (struct nrf24_ll_data_pdu *) p.payload;
+	llctrl = (struct nrf24_ll_crtl_pdu *) opdu->payload;
+	llnack = (struct nrf24_ll_nack *) llctrl->payload;
+
+	opdu->lid = NRF24_PDU_LID_CONTROL;
+	llctrl->opcode = NRF24_LL_CRTL_OP_NACK;
+	llnack->msgid = msgid;
+	llnack->missing = missing;
+
+	len = sizeof(*opdu) + sizeof(*llctrl) + sizeof(*llnack);
+
+	DBG_SEND(&adapter->mac_local, &adapter->peers[sockfd - 1].mac,
+					(const uint8_t *) opdu, len);
+
+	err = phy_write(adapter->driver, &p, len);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+static int check_keepalive(struct nrf24_adapter *adapter, int sockfd)
+{
+	struct nrf24_data *peers = adapter->peers;
+	uint32_t time_ms = hal_time_ms();
+	int err;
+
+	/* Check if timeout occurred */
+#ifndef ARDUINO
+	if (peers[sockfd-1].link_lost)
+		return -ETIMEDOUT;
+#else
+	if (hal_timeout(time_ms, peers[sockfd-1].keepalive_anchor,
+						NRF24_KEEPALIVE_TIMEOUT_MS) > 0)
+		return -ETIMEDOUT;
+#endif
+
+	/* Acceptor: link options confirmed before any request */
+	if (peers[sockfd-1].opts & OPTS_CONFIRM) {
+		err = write_keepalive(adapter, sockfd,
+				      NRF24_LL_CRTL_OP_KEEPALIVE_RSP,
+				      &peers[sockfd-1].mac, &adapter->mac_local);
+		if (err < 0)
+			return err;
+
+		peers[sockfd-1].opts &= ~OPTS_CONFIRM;
+	}
+
+	/* Disabled? (Acceptor is always 0) */
+	if (peers[sockfd-1].keepalive == 0)
+		return 0;
+
+	if (hal_timeout(time_ms, peers[sockfd-1].keepalive_anchor,
+		peers[sockfd-1].keepalive * NRF24_KEEPALIVE_SEND_MS) <= 0)
+		return 0;
+
+	/* Sends keepalive packet: retried while the peer is unreachable */
+	err = write_keepalive(adapter, sockfd,
+			      NRF24_LL_CRTL_OP_KEEPALIVE_REQ,
+			      &peers[sockfd-1].mac, &adapter->mac_local);
+	if (err < 0)
+		return err;
+
+	/* The previous request has not been answered */
+	if (peers[sockfd-1].keepalive > 1)
+		STATS_ADD(&peers[sockfd-1], keepalive_missed, 1);
+#ifndef ARDUINO
+	peers[sockfd-1].keepalive_sent = time_ms;
+#endif
+
+	peers[sockfd-1].keepalive++;
+
+	return 0;
+}
+
+static int write_mgmt(struct nrf24_adapter *adapter)
+{
+	struct nrf24_mgmt *mgmt = &adapter->mgmt;
+	int err, slot;
+	struct nrf24_io_pack p;
+
+	/* If nothing to do */
+	slot = ring_peek_read(&mgmt->tx_ring);
+	if (slot < 0)
+		return -EAGAIN;
+
+	/* Set pipe to be sent */
+	p.pipe = 0;
+	/* Copy tx message to payload */
+	memcpy(p.payload, mgmt->tx[slot].data, mgmt->tx[slot].len);
+
+	err = phy_write(adapter->driver, &p, mgmt->tx[slot].len);
+	if (err < 0)
+		return err;
+
+	/* Release tx message */
+	ring_commit_read(&mgmt->tx_ring);
+
+	return err;
+}
+
+static int read_mgmt(struct nrf24_adapter *adapter)
+{
+	struct nrf24_io_pack p;
+	struct nrf24_ll_mgmt_pdu *ipdu;
+	struct mgmt_evt_nrf24_bcast_presence *mgmtev_bcast;
+	struct mgmt_evt_nrf24_connected *mgmtev_cn;
+	struct mgmt_nrf24_header *mgmtev_hdr;
+	struct nrf24_ll_mgmt_connect *llc;
+	struct nrf24_ll_presence *llp;
+	struct nrf24_mac mac;
+	ssize_t ilen;
+
+	/* Read from management pipe */
+	memset(&p, 0, sizeof(p));
+
+	ipdu = (struct nrf24_ll_mgmt_pdu *)p.payload;
+	/* Read data */
+	ilen = phy_read(adapter->driver, &p, NRF24_MTU);
+	if (ilen <= 0)
+		return -EAGAIN;
+
+	switch (ipdu->type) {
+	/* If is a presente type */
+	case NRF24_PDU_TYPE_PRESENCE:
+
+		/*
+		 * If broadcasting: Ignore presence from other devices.
 		 * TODO: Find a better approach to manage this scenario.
 		 */
-		if (listen)
+		if (adapter->listen)
 			return -EAGAIN;
 
 		if (ilen < (ssize_t) (sizeof(struct nrf24_ll_mgmt_pdu) +
 					sizeof(struct nrf24_ll_presence)))
 			return -EINVAL;
 
+		/* Presence structure: packed, its mac may be unaligned */
+		llp = (struct nrf24_ll_presence *) ipdu->payload;
+		mac.address.uint64 = llp->mac.address.uint64;
+
+		/* Reported recently or already queued: skip */
+		if (presence_duplicated(adapter, &mac))
+			return -EAGAIN;
+
+		mgmtev_hdr = mgmt_presence_get(adapter, &mac);
+		if (mgmtev_hdr == NULL)
+			return -EAGAIN;
+
 		/* Event presence structure */
 		mgmtev_bcast = (struct mgmt_evt_nrf24_bcast_presence *)mgmtev_hdr->payload;
-		/* Presence structure */
-		llp = (struct nrf24_ll_presence *) ipdu->payload;
 
 		/* Header type is a broadcast presence */
 		mgmtev_hdr->opcode = MGMT_EVT_NRF24_BCAST_PRESENCE;
-		mgmtev_hdr->index = 0;
+		mgmtev_hdr->index = adapter - adapters;
 		/* Copy source address */
 		mgmtev_bcast->mac.address.uint64 = llp->mac.address.uint64;
 		mgmtev_bcast->id = llp->id;
@@ -457,11 +1284,12 @@ static int read_mgmt(int spi_fd)
 				ilen - sizeof(*llp) - sizeof(*ipdu));
 
 		/*
-		 * The rx buffer length is equal to the
+		 * The event length is equal to the
 		 * event header length + presence packet length.
 		 * Presence packet len = (input len - mgmt_pdu header len)
 		 */
-		mgmt.len_rx = ilen - sizeof(*ipdu) + sizeof(*mgmtev_hdr);
+		mgmt_presence_commit(adapter, ilen - sizeof(*ipdu) +
+						sizeof(*mgmtev_hdr));
 
 		break;
 	/* If is a connect request type */
@@ -471,18 +1299,25 @@ static int read_mgmt(int spi_fd)
 			     sizeof(struct nrf24_ll_mgmt_connect)))
 			return -EINVAL;
 
-		/* Event connect structure */
-		mgmtev_cn = (struct mgmt_evt_nrf24_connected *)mgmtev_hdr->payload;
 		/* Link layer connect structure */
 		llc = (struct nrf24_ll_mgmt_connect *) ipdu->payload;
 
 		/* Do not copy to upper layer if address doesn't match */
-		if (llc->dst_addr.address.uint64 != mac_local.address.uint64)
+		if (llc->dst_addr.address.uint64 !=
+					adapter->mac_local.address.uint64)
 			return -EAGAIN;
 
+		/* If the event queue is full then return BUSY */
+		mgmtev_hdr = mgmt_evt_get(adapter);
+		if (mgmtev_hdr == NULL)
+			return -EBUSY;
+
+		/* Event connect structure */
+		mgmtev_cn = (struct mgmt_evt_nrf24_connected *)mgmtev_hdr->payload;
+
 		/* Header type is a connect request type */
 		mgmtev_hdr->opcode = MGMT_EVT_NRF24_CONNECTED;
-		mgmtev_hdr->index = 0;
+		mgmtev_hdr->index = adapter - adapters;
 		/* Copy src and dst address*/
 		mgmtev_cn->src.address.uint64 = llc->src_addr.address.uint64;
 		mgmtev_cn->dst.address.uint64 = llc->dst_addr.address.uint64;
@@ -490,8 +1325,10 @@ static int read_mgmt(int spi_fd)
 		mgmtev_cn->channel = llc->channel;
 		/* Copy access address */
 		memcpy(mgmtev_cn->aa, llc->aa, sizeof(mgmtev_cn->aa));
+		mgmtev_cn->opts = ipdu->opts;
 
-		mgmt.len_rx = sizeof(*mgmtev_hdr) + sizeof(*mgmtev_cn);
+		mgmt_evt_commit(adapter, sizeof(*mgmtev_hdr) +
+						sizeof(*mgmtev_cn));
 
 		DBG_RECV(&llc->src_addr, &llc->dst_addr, (const uint8_t *) ipdu, ilen);
 
@@ -504,91 +1341,267 @@ static int read_mgmt(int spi_fd)
 	return ilen;
 }
 
-static int write_raw(int spi_fd, int sockfd)
+/* Oldest message of the tx queue has been acknowledged or dropped */
+static void write_raw_release(struct nrf24_adapter *adapter,
+				struct nrf24_data *peer, struct data_msg *msg)
 {
-	int err;
+	chunk_free(&adapter->tx_pool, msg->chunk, MSG_CHUNKS(msg->len));
+	ring_commit_read(&peer->tx_ring);
+	peer->tx_frags = 0;
+	peer->write_rt = 0;
+	peer->msgid_tx++;
+}
+
+/* Fills opdu with the fragment nseq (data in chunk): returns its length */
+static size_t frag_fill(struct nrf24_adapter *adapter, struct nrf24_data *peer,
+			const struct data_msg *msg, uint8_t nseq,
+			uint8_t chunk, struct nrf24_ll_data_pdu *opdu)
+{
+	uint8_t last = (msg->len - 1) / NRF24_PW_MSG_SIZE;
+	size_t offset = nseq * NRF24_PW_MSG_SIZE;
+	size_t plen = _MIN(msg->len - offset, NRF24_PW_MSG_SIZE);
+
+	opdu->lid = (nseq == last) ?
+		NRF24_PDU_LID_DATA_END : NRF24_PDU_LID_DATA_FRAG;
+	opdu->nseq = nseq;
+	opdu->msgid = peer->msgid_tx;
+	memcpy(opdu->payload, adapter->tx_pool.data[chunk], plen);
+
+	DBG_SEND(&adapter->mac_local, &peer->mac,
+		(const uint8_t *) opdu, plen + DATA_HDR_SIZE);
+
+	return plen + DATA_HDR_SIZE;
+}
+
+/* Fragments of the oldest message not acknowledged yet */
+static int frags_pending(struct nrf24_data *peer, const struct data_msg *msg)
+{
+	uint64_t pending = FRAG_MASK((msg->len - 1) / NRF24_PW_MSG_SIZE) &
+							~peer->tx_frags;
+	int count;
+
+	for (count = 0; pending; pending &= pending - 1)
+		count++;
+
+	return count;
+}
+
+/*
+ * Sends the fragments of the oldest message not acknowledged yet.
+ * Returns the amount of fragments pending, zero if the message has
+ * been sent or a negative error if nothing was acknowledged.
+ */
+static int write_raw(struct nrf24_adapter *adapter, int sockfd)
+{
+	struct nrf24_data *peer = &adapter->peers[sockfd-1];
+	struct data_msg *msg;
 	struct nrf24_io_pack p;
 	struct nrf24_ll_data_pdu *opdu;
-	size_t plen;
+	uint8_t nseq, base, last, chunk, sent = 0, acked;
+	uint8_t queued[ARQ_BURST];
+	size_t len;
+	int err = 0, slot, done;
 
-	/* If has nothing to send, returns EBUSY */
-	if (peers[sockfd-1].len_tx == 0)
+	/* If has nothing to send, returns EAGAIN */
+	slot = ring_peek_read(&peer->tx_ring);
+	if (slot < 0)
 		return -EAGAIN;
 
-	/* If len is larger than the maximum message size */
-	if (peers[sockfd-1].len_tx > DATA_SIZE)
-		return -EINVAL;
+	msg = tx_msg(adapter, sockfd, slot);
+	last = (msg->len - 1) / NRF24_PW_MSG_SIZE;
+
+	/* Window starts at the oldest fragment not acknowledged */
+	for (base = 0; peer->tx_frags & FRAG_BIT(base); base++)
+		;
 
 	memset(&p, 0, sizeof(p));
 
 	/* Set pipe to be sent */
-	p.pipe = sockfd;
+	p.pipe = peer->pipe;
 
 	opdu = (void *)p.payload;
 
-	/*
-	 * If left is larger than the NRF24_PW_MSG_SIZE,
-	 * payload length = NRF24_PW_MSG_SIZE,
-	 * if not, payload length = left
-	 */
-	plen = _MIN(peers[sockfd-1].len_tx, NRF24_PW_MSG_SIZE);
+	chunk = chunk_at(&adapter->tx_pool, msg->chunk, base);
 
-	/*
-	 * If write_offset is larger than the NRF24_PW_MSG_SIZE,
-	 * it means that the packet is fragmented,
-	 * if not, it means that it is the last packet.
-	 */
-	opdu->lid = ((peers[sockfd-1].len_tx) > NRF24_PW_MSG_SIZE) ?
-			NRF24_PDU_LID_DATA_FRAG : NRF24_PDU_LID_DATA_END;
+	/* Radio in PTX to the peer until the end of the burst */
+	phy_ioctl(adapter->driver, NRF24_CMD_STREAM_BEGIN, &p.pipe);
 
-	/* Packet sequence number */
-	opdu->nseq = peers[sockfd-1].seqnumber_tx;
+	for (nseq = base; nseq <= last && nseq < base + ARQ_WINDOW &&
+			sent < ARQ_BURST; nseq++,
+			chunk = adapter->tx_pool.next[chunk]) {
+		if (peer->tx_frags & FRAG_BIT(nseq))
+			continue;
 
-	/* Offset = len - write_offset */
-	memcpy(opdu->payload,
-	       peers[sockfd-1].buffer_tx + peers[sockfd-1].write_offset,
-	       plen);
+		len = frag_fill(adapter, peer, msg, nseq, chunk, opdu);
 
-	DBG_SEND(&mac_local, &peers[sockfd - 1].mac,
-		(const uint8_t *) opdu, plen + DATA_HDR_SIZE);
+		/* Not acknowledged: stream stopped, try again next time */
+		err = phy_write(adapter->driver, &p, len);
+		if (err < 0)
+			break;
 
-	/* Send packet */
-	err = phy_write(spi_fd, &p, plen + DATA_HDR_SIZE);
-	/*
-	 * If write error then reset tx len
-	 * and sequence number
-	 */
-	if (err < 0) {
-		if (peers[sockfd-1].write_rt >= MAX_RT){
-			peers[sockfd-1].len_tx = 0;
-			peers[sockfd-1].write_rt = 0;
-			peers[sockfd-1].write_offset = 0;
-			peers[sockfd-1].seqnumber_tx = 0;
+		queued[sent++] = nseq;
+	}
+
+	/* Fragments acknowledged, in the order they were queued */
+	done = phy_ioctl(adapter->driver, NRF24_CMD_STREAM_END, NULL);
+	acked = (done < 0 ? 0 : _MIN(done, sent));
+	if (acked < sent)
+		err = -EAGAIN;
+
+	for (nseq = 0; nseq < acked; nseq++)
+		peer->tx_frags |= FRAG_BIT(queued[nseq]);
+
+	STATS_ADD(peer, tx_frames, acked);
+
+	if (acked == 0 && err < 0) {
+		if (peer->write_rt == 0)
+			peer->write_anchor = hal_time_ms();
+
+		/*
+		 * Drop the message if there isn't progress: the peer
+		 * may be out of its RAW window for a while. A gateway
+		 * serving more peers than pipes may also have parked
+		 * the acceptor (keepalive disabled) for some windows.
+		 */
+		if (peer->write_rt >= MAX_RT && hal_timeout(hal_time_ms(),
+				peer->write_anchor, peer->keepalive ?
+				ARQ_TIMEOUT : ARQ_PARKED_TIMEOUT) > 0) {
+			STATS_ADD(peer, tx_dropped, 1);
+			write_raw_release(adapter, peer, msg);
 			return err;
 		}
-		peers[sockfd-1].write_rt++;
-		/* TODO: Handle transmission error */
 
-	}
-
-	peers[sockfd-1].write_offset += plen;
-	peers[sockfd-1].len_tx -= plen;
-	peers[sockfd-1].seqnumber_tx++;
+		if (peer->write_rt < MAX_RT)
+			peer->write_rt++;
 
+		return err;
+	}
 
-	err = peers[sockfd-1].len_tx;
+	peer->write_rt = 0;
 
-	/* End of buffer */
+	err = frags_pending(peer, msg);
 	if (err == 0) {
-		peers[sockfd-1].write_rt = 0;
-		peers[sockfd-1].write_offset = 0;
-		peers[sockfd-1].seqnumber_tx = 0;
+		/* End of message: release tx slot */
+		STATS_ADD(peer, tx_msgs, 1);
+		STATS_ADD(peer, tx_bytes, msg->len);
+		write_raw_release(adapter, peer, msg);
 	}
 
+	/* Fragments pending */
 	return err;
 }
 
-static int read_raw(int spi_fd)
+/*
+ * ACK payload link (gateway side): the oldest fragment not acknowledged
+ * is loaded as payload of the next ACK sent to the peer, it leaves with
+ * the next packet received from it. The radio holds one at a time: if
+ * loaded for another peer or if the peer is silent (ACK_HOLD),
+ * write_raw() is used instead. Returns as write_raw().
+ */
+static int write_ack(struct nrf24_adapter *adapter, int sockfd)
+{
+	struct nrf24_data *peer = &adapter->peers[sockfd-1];
+	struct data_msg *msg;
+	struct ack_payload ack;
+	uint8_t nseq;
+	bool silent;
+	int slot, err;
+
+	slot = ring_peek_read(&peer->tx_ring);
+	if (slot < 0)
+		return -EAGAIN;
+
+	msg = tx_msg(adapter, sockfd, slot);
+
+	silent = (hal_timeout(hal_time_ms(), peer->keepalive_anchor,
+							ACK_HOLD) > 0);
+
+	if (adapter->ack_sockfd == sockfd) {
+		err = phy_ioctl(adapter->driver, NRF24_CMD_ACK_PAYLOAD_STATUS,
+									NULL);
+		if (err == 0) {
+			if (!silent)
+				return -EAGAIN;
+
+			/* Peer silent: written as usual (TX FIFO flushed) */
+			adapter->ack_sockfd = 0;
+			return write_raw(adapter, sockfd);
+		}
+
+		adapter->ack_sockfd = 0;
+
+		/* Sent: not acknowledged by the peer, but ACKs rarely fail */
+		if (err > 0 && adapter->ack_msgid == peer->msgid_tx) {
+			peer->tx_frags |= FRAG_BIT(adapter->ack_nseq);
+			peer->write_rt = 0;
+			STATS_ADD(peer, tx_frames, 1);
+
+			if (frags_pending(peer, msg) == 0) {
+				STATS_ADD(peer, tx_msgs, 1);
+				STATS_ADD(peer, tx_bytes, msg->len);
+				write_raw_release(adapter, peer, msg);
+				return 0;
+			}
+		}
+	}
+
+	if (silent || adapter->ack_sockfd != 0)
+		return write_raw(adapter, sockfd);
+
+	for (nseq = 0; peer->tx_frags & FRAG_BIT(nseq); nseq++)
+		;
+
+	ack.pipe = peer->pipe;
+	ack.len = frag_fill(adapter, peer, msg, nseq,
+			chunk_at(&adapter->tx_pool, msg->chunk, nseq),
+			(struct nrf24_ll_data_pdu *) ack.payload);
+
+	if (phy_ioctl(adapter->driver, NRF24_CMD_ACK_PAYLOAD, &ack) < 0)
+		return write_raw(adapter, sockfd);
+
+	adapter->ack_sockfd = sockfd;
+	adapter->ack_msgid = peer->msgid_tx;
+	adapter->ack_nseq = nseq;
+
+	return frags_pending(peer, msg);
+}
+
+/*
+ * Message of a data PDU. Peers without NRF24_LL_OPT_MSGID (older link
+ * layer) leave the byte zeroed and send the fragments in order: each
+ * fragment 0 starts a message, unless it is the only one received so
+ * far (retransmission).
+ */
+static uint8_t rx_msgid(const struct nrf24_data *peer,
+				const struct nrf24_ll_data_pdu *ipdu)
+{
+	if (peer->opts & NRF24_LL_OPT_MSGID)
+		return ipdu->msgid;
+
+	if (ipdu->nseq != 0 || (peer->rx_state == RX_ACTIVE &&
+					peer->rx_frags == FRAG_BIT(0)))
+		return peer->msgid_rx;
+
+	return peer->msgid_rx + 1;
+}
+
+/* Master: link options accepted by the slave (keepalive response) */
+static void opts_confirmed(struct nrf24_adapter *adapter,
+				struct nrf24_data *peer, uint8_t opts)
+{
+	opts &= NRF24_LL_OPT_MSGID |
+		(adapter->config->flags & NRF24_FLAG_ACK_PAYLOAD ?
+					NRF24_LL_OPT_ACK_PAYLOAD : 0);
+
+	/* msgid_rx was counted locally: it may match the next message */
+	if ((opts & ~peer->opts & NRF24_LL_OPT_MSGID) &&
+					peer->rx_state == RX_SKIP)
+		peer->rx_state = RX_NEW;
+
+	peer->opts = opts;
+}
+
+static int read_raw(struct nrf24_adapter *adapter)
 {
 	struct nrf24_io_pack p;
 	const struct nrf24_ll_data_pdu *ipdu;
@@ -597,32 +1610,43 @@ static int read_raw(int spi_fd)
 	struct nrf24_ll_disconnect *lldc;
 	struct nrf24_ll_keepalive *llkeepalive;
 	struct nrf24_ll_crtl_pdu *llctrl;
-	size_t plen;
+	struct nrf24_ll_nack *llnack;
+	size_t plen, offset;
 	ssize_t ilen;
 	struct nrf24_data *peer;
+	struct data_msg *msg;
+	uint64_t frags;
+	uint8_t chunk, msgid;
+	int slot, sockfd;
 
 
 	memset(&p, 0, sizeof(p));
 
-	p.pipe = NRF24_ANY_PIPE;
-
 	ipdu = (void *) p.payload;
 
 	/*
 	 * Reads the data while to exist,
-	 * on success, the number of bytes read is returned
+	 * on success, the number of bytes read is returned.
+	 * The pipe read is returned in p.pipe: any pipe again
+	 * (ACK payloads on pipe 0 interleave with data pipes).
 	 */
-	while ((ilen = phy_read(spi_fd, &p, NRF24_MTU)) > 0) {
+	for (p.pipe = NRF24_ANY_PIPE;
+		(ilen = phy_read(adapter->driver, &p, NRF24_MTU)) > 0;
+						p.pipe = NRF24_ANY_PIPE) {
 
-		if (!(pipe_bitmask & (1 << p.pipe)))
+		/* Data pipe bound to a peer? */
+		if (p.pipe > PIPE_COUNTER || adapter->pipe_peer[p.pipe] == 0)
 			continue;
 
-		peer = &peers[p.pipe-1];
+		sockfd = adapter->pipe_peer[p.pipe];
+		peer = &adapter->peers[sockfd - 1];
 
 		/* Initiator/acceptor: reset anchor */
-		DBG_RECV(&mac_local, &peer->mac, (const uint8_t *) ipdu, ilen);
+		DBG_RECV(&adapter->mac_local, &peer->mac,
+					(const uint8_t *) ipdu, ilen);
 
-		peer->keepalive_anchor = hal_time_ms();
+		keepalive_restart(adapter, peer);
+		STATS_ADD(peer, rx_frames, 1);
 
 		/* Check if is data or Control */
 		switch (ipdu->lid) {
@@ -633,36 +1657,64 @@ static int read_raw(int spi_fd)
 			llkeepalive = (struct nrf24_ll_keepalive *)
 							llctrl->payload;
 			lldc = (struct nrf24_ll_disconnect *) llctrl->payload;
+			llnack = (struct nrf24_ll_nack *) llctrl->payload;
 
 			if (llctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_REQ &&
 				llkeepalive->src_addr.address.uint64 ==
 				peer->mac.address.uint64 &&
 				llkeepalive->dst_addr.address.uint64 ==
-				mac_local.address.uint64) {
-				write_keepalive(spi_fd, p.pipe,
+				adapter->mac_local.address.uint64) {
+				write_keepalive(adapter, sockfd,
 					NRF24_LL_CRTL_OP_KEEPALIVE_RSP,
-					&peer->mac, &mac_local);
+					&peer->mac, &adapter->mac_local);
 
 			} else if (llctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_RSP) {
 				/* Disabled? (Acceptor is always 0) */
 				if (peer->keepalive != 0)
 					/* Incoming data: reset keepalive counter */
 					peer->keepalive = 1;
+
+#ifndef ARDUINO
+				/* Round trip of the last request */
+				if (peer->keepalive_sent != 0) {
+					peer->stats.keepalive_rtt = _MIN(
+						peer->keepalive_anchor -
+						peer->keepalive_sent,
+						UINT16_MAX);
+					peer->keepalive_sent = 0;
+				}
+#endif
+
+				/* Master: options confirmed by the slave */
+				if (peer->keepalive != 0 && (size_t) ilen >
+						DATA_HDR_SIZE + sizeof(*llctrl) +
+						sizeof(*llkeepalive))
+					opts_confirmed(adapter, peer,
+							llkeepalive->opts[0]);
+			}
+
+			/* Missing fragments of the message in flight */
+			else if (llctrl->opcode == NRF24_LL_CRTL_OP_NACK) {
+				if (llnack->msgid == peer->msgid_tx &&
+					ring_peek_read(&peer->tx_ring) >= 0) {
+					peer->tx_frags &= ~llnack->missing;
+					/* Receiver is alive: keep trying */
+					peer->write_rt = 0;
+				}
 			}
 
 			/* If packet is disconnect request */
 			else if (llctrl->opcode == NRF24_LL_CRTL_OP_DISCONNECT &&
-							mgmt.len_rx == 0) {
-				mgmtev_hdr = (struct mgmt_nrf24_header *)
-								mgmt.buffer_rx;
+				(mgmtev_hdr = mgmt_evt_get(adapter)) != NULL) {
 				mgmtev_dc = (struct mgmt_evt_nrf24_disconnected *)
 							mgmtev_hdr->payload;
 
 				mgmtev_hdr->opcode = MGMT_EVT_NRF24_DISCONNECTED;
+				mgmtev_hdr->index = adapter - adapters;
 				mgmtev_dc->mac.address.uint64 =
 					lldc->src_addr.address.uint64;
-				mgmt.len_rx = sizeof(*mgmtev_hdr) +
-							sizeof(*mgmtev_dc);
+				mgmt_evt_commit(adapter, sizeof(*mgmtev_hdr) +
+							sizeof(*mgmtev_dc));
 			}
 
 			break;
@@ -674,57 +1726,124 @@ static int read_raw(int spi_fd)
 				/* Incoming data: reset keepalive counter */
 				peer->keepalive = 1;
 
-			if (peer->len_rx != 0)
-				break; /* Discard packet */
+			/* Peer is sending: hold the data channel */
+			adapter->raw_activity = peer->keepalive_anchor;
+
+			msgid = rx_msgid(peer, ipdu);
 
-			/* Reset offset if sequence number is zero */
-			if (ipdu->nseq == 0) {
-				peer->offset_rx = 0;
-				peer->seqnumber_rx = 0;
+			/* Retransmission of a message already handled */
+			if (peer->rx_state == RX_SKIP &&
+					msgid == peer->msgid_rx) {
+				STATS_ADD(peer, rx_duplicated, 1);
+				break;
 			}
 
-			/* If sequence number error */
-			if (peer->seqnumber_rx < ipdu->nseq)
-				break;
-				/*
-				 * TODO: disconnect, data error!?!?!?
-				 * Illegal byte sequence
-				 */
+			/*
+			 * New message: reassembly in the next free rx slot.
+			 * A partial message is dropped (sender gave up).
+			 * Queue full: discard the new message or the oldest.
+			 */
+			if (peer->rx_state != RX_ACTIVE ||
+					msgid != peer->msgid_rx) {
+				if (peer->rx_state == RX_ACTIVE)
+					STATS_ADD(peer, rx_errors, 1);
+
+				peer->msgid_rx = msgid;
+				peer->rx_frags = 0;
+				peer->rx_last = NSEQ_NONE;
+				peer->rx_state = RX_ACTIVE;
+
+				slot = ring_peek_write(&peer->rx_ring);
+				if (slot < 0 && (adapter->config->flags &
+						NRF24_FLAG_DROP_OLDEST) &&
+					ring_drop_oldest(&peer->rx_ring)) {
+					peer->rx_dropped++;
+					/* Its chunks are reused */
+					slot = ring_peek_write(&peer->rx_ring);
+					msg = rx_msg(adapter, sockfd, slot);
+					rx_chunk_append(adapter, peer,
+						msg->chunk,
+						MSG_CHUNKS(msg->len));
+				}
+			}
 
-			if (peer->seqnumber_rx > ipdu->nseq)
-				break; /* Discard packet duplicated */
+			slot = ring_peek_write(&peer->rx_ring);
+			if (slot < 0) {
+				peer->rx_dropped++;
+				peer->rx_state = RX_SKIP;
+				break; /* Discard message */
+			}
+
+			msg = rx_msg(adapter, sockfd, slot);
 
 			/* Payloag length = input length - header size */
 			plen = ilen - DATA_HDR_SIZE;
+			offset = ipdu->nseq * NRF24_PW_MSG_SIZE;
 
-			if (ipdu->lid == NRF24_PDU_LID_DATA_FRAG &&
-				plen < NRF24_PW_MSG_SIZE)
-				break;
+			if ((ipdu->lid == NRF24_PDU_LID_DATA_FRAG &&
+				plen < NRF24_PW_MSG_SIZE) ||
+					offset >= adapter->msg_size) {
 				/*
 				 * TODO: disconnect, data error!?!?!?
 				 * Not a data message
 				 */
+				STATS_ADD(peer, rx_errors, 1);
+				break;
+			}
 
-			/* Reads no more than DATA_SIZE bytes */
-			if (peer->offset_rx + plen > DATA_SIZE)
-				plen = DATA_SIZE - peer->offset_rx;
-
-			memcpy(peer->buffer_rx +
-				peer->offset_rx, ipdu->payload, plen);
-			peer->offset_rx += plen;
-			peer->seqnumber_rx++;
+			/* Reads no more than msg_size bytes */
+			if (offset + plen > adapter->msg_size)
+				plen = adapter->msg_size - offset;
+
+			/* Duplicated fragments are ignored */
+			if (!(peer->rx_frags & FRAG_BIT(ipdu->nseq))) {
+				chunk = rx_chunk_at(adapter, peer, ipdu->nseq);
+				if (chunk == CHUNK_NONE) {
+					/* Pool exhausted */
+					peer->rx_dropped++;
+					peer->rx_state = RX_SKIP;
+					break;
+				}
+
+				memcpy(adapter->rx_pool.data[chunk],
+							ipdu->payload, plen);
+				peer->rx_frags |= FRAG_BIT(ipdu->nseq);
+			} else {
+				STATS_ADD(peer, rx_duplicated, 1);
+			}
 
-			/* If is DATA_END then put in rx buffer */
 			if (ipdu->lid == NRF24_PDU_LID_DATA_END) {
-				/* Sets packet length read */
-				peer->len_rx = peer->offset_rx;
+				peer->rx_last = ipdu->nseq;
+				peer->rx_len = offset + plen;
+			}
 
-				/*
-				 * If the complete msg is received,
-				 * resets the controls
-				 */
-				peer->seqnumber_rx = 0;
-				peer->offset_rx = 0;
+			/* Last fragment not received yet */
+			if (peer->rx_last == NSEQ_NONE)
+				break;
+
+			frags = FRAG_MASK(peer->rx_last);
+
+			/* If complete then publish the message */
+			if ((peer->rx_frags & frags) == frags) {
+				/* Unused chunks are kept for the next one */
+				chunk = chunk_at(&adapter->rx_pool,
+						peer->rx_chunk, peer->rx_last);
+				msg->chunk = peer->rx_chunk;
+				peer->rx_chunk = adapter->rx_pool.next[chunk];
+				peer->rx_chunks -= peer->rx_last + 1;
+				adapter->rx_pool.next[chunk] = CHUNK_NONE;
+
+				/* Sets packet length read */
+				msg->len = peer->rx_len;
+				ring_commit_write(&peer->rx_ring);
+				peer->rx_state = RX_SKIP;
+				STATS_ADD(peer, rx_msgs, 1);
+				STATS_ADD(peer, rx_bytes, msg->len);
+			} else if (ipdu->lid == NRF24_PDU_LID_DATA_END &&
+					(peer->opts & NRF24_LL_OPT_MSGID)) {
+				/* Ask only the missing fragments */
+				write_nack(adapter, sockfd, peer->msgid_rx,
+						frags & ~peer->rx_frags);
 			}
 			break;
 		}
@@ -738,26 +1857,26 @@ static int read_raw(int spi_fd)
  * windows_bcast time and go to standy by mode during
  * (interval_bcast - windows_bcast) time
  */
-static void presence_connect(int spi_fd)
+static void presence_connect(struct nrf24_adapter *adapter)
 {
+	const struct nrf24_config *config = adapter->config;
 	struct nrf24_io_pack p;
 	struct nrf24_ll_mgmt_pdu *opdu = (void *)p.payload;
 	struct nrf24_ll_presence *llp =
 				(struct nrf24_ll_presence *) opdu->payload;
 	size_t len, nameLen;
 	int err;
-	static unsigned long start;
 
-	switch (presence_connect_state) {
+	switch (adapter->presence_connect_state) {
 	case PRESENCE:
 		/* Send Presence */
-		if (mac_local.address.uint64 == 0)
+		if (adapter->mac_local.address.uint64 == 0)
 			break;
 
 		p.pipe = 0;
 		opdu->type = NRF24_PDU_TYPE_PRESENCE;
 		/* Send the mac address and thing name */
-		llp->mac.address.uint64 = mac_local.address.uint64;
+		llp->mac.address.uint64 = adapter->mac_local.address.uint64;
 		llp->id = config->id;
 
 		len = sizeof(*opdu) + sizeof(*llp);
@@ -776,275 +1895,931 @@ static void presence_connect(int spi_fd)
 		/* Increments name length */
 		len += nameLen;
 
-		err = phy_write(spi_fd, &p, len);
+		err = phy_write(adapter->driver, &p, len);
 		if (err < 0)
 			break;
 		/* Init time */
-		if (previous_state == TIMEOUT_INTERVAL)
-			start = hal_time_ms();
+		if (adapter->previous_state == TIMEOUT_INTERVAL)
+			adapter->presence_start = hal_time_ms();
 
-		presence_connect_state = BURST_WINDOW;
+		adapter->presence_connect_state = BURST_WINDOW;
 		break;
 	case BURST_WINDOW:
-		if (hal_timeout(hal_time_ms(), start, WINDOW_BCAST) > 0)
-			presence_connect_state = STANDBY;
-		else if (hal_timeout(hal_time_ms(), start, BURST_BCAST) > 0)
-			presence_connect_state = PRESENCE;
-
-		previous_state = BURST_WINDOW;
+		if (hal_timeout(hal_time_ms(), adapter->presence_start,
+							WINDOW_BCAST) > 0)
+			adapter->presence_connect_state = STANDBY;
+		else if (hal_timeout(hal_time_ms(), adapter->presence_start,
+							BURST_BCAST) > 0)
+			adapter->presence_connect_state = PRESENCE;
+
+		adapter->previous_state = BURST_WINDOW;
 		break;
 	case STANDBY:
-		phy_ioctl(spi_fd, NRF24_CMD_SET_STANDBY, NULL);
-		presence_connect_state = TIMEOUT_INTERVAL;
+		phy_ioctl(adapter->driver, NRF24_CMD_SET_STANDBY, NULL);
+		adapter->presence_connect_state = TIMEOUT_INTERVAL;
 		break;
 	case TIMEOUT_INTERVAL:
-		if (hal_timeout(hal_time_ms(), start, INTERVAL_BCAST) > 0)
-			presence_connect_state = PRESENCE;
+		if (hal_timeout(hal_time_ms(), adapter->presence_start,
+							INTERVAL_BCAST) > 0)
+			adapter->presence_connect_state = PRESENCE;
 
-		previous_state = TIMEOUT_INTERVAL;
+		adapter->previous_state = TIMEOUT_INTERVAL;
 		break;
 	}
 }
 
-static void running(void)
+/*
+ * If keepalive is enabled: sends the request when due. Timeout
+ * generates the disconnect event and releases the pipe.
+ */
+static void check_peer(struct nrf24_adapter *adapter, int sockfd)
 {
+	struct nrf24_data *peer = &adapter->peers[sockfd - 1];
 	struct mgmt_nrf24_header *mgmtev_hdr;
 	struct mgmt_evt_nrf24_disconnected *mgmtev_dc;
-	/* Index peers */
-	static int sockIndex = 1;
-	static unsigned long start;
 
-	switch (running_state) {
+	if (check_keepalive(adapter, sockfd) != -ETIMEDOUT)
+		return;
+
+	mgmtev_hdr = mgmt_evt_get(adapter);
+	if (mgmtev_hdr == NULL)
+		return;
+
+	mgmtev_dc = (struct mgmt_evt_nrf24_disconnected *) mgmtev_hdr->payload;
+
+	mgmtev_hdr->opcode = MGMT_EVT_NRF24_DISCONNECTED;
+	mgmtev_hdr->index = adapter - adapters;
+
+	mgmtev_dc->mac.address.uint64 = peer->mac.address.uint64;
+	mgmt_evt_commit(adapter, sizeof(*mgmtev_hdr) + sizeof(*mgmtev_dc));
+
+	/* TODO: Send disconnect packet to slave */
+
+	/* Free pipe */
+	pipe_unbind(adapter, peer);
+	peer->pipe = -1;
+	peer->keepalive = 0;
+
+	/* Received messages may still be read: released on close */
+	peer_release(adapter, sockfd, false);
+}
+
+/*
+ * Peer transferring data: messages queued to send or a message being
+ * received (the sender didn't give up on it).
+ */
+static bool peer_busy(const struct nrf24_data *peer, uint32_t now)
+{
+	if (ring_count(&peer->tx_ring))
+		return true;
+
+	return (peer->rx_state == RX_ACTIVE &&
+		hal_timeout(now, peer->keepalive_anchor, ARQ_TIMEOUT) == 0);
+}
+
+/*
+ * Peers bound to a data pipe using the data channel: busy or with a
+ * keepalive request to be sent. Both ends alternate channels on their
+ * own, the longer window of a busy peer overlaps the whole cycle of
+ * the other.
+ */
+static uint8_t raw_pending(struct nrf24_adapter *adapter)
+{
+	struct nrf24_data *peers = adapter->peers;
+	uint32_t now = hal_time_ms();
+	uint8_t i, pending = 0;
+
+	for (i = 0; i < CONNECTION_COUNTER; i++) {
+		if (peers[i].pipe <= 0)
+			continue;
+
+		if (peer_busy(&peers[i], now) || (peers[i].keepalive != 0 &&
+			hal_timeout(now, peers[i].keepalive_anchor,
+					peers[i].keepalive *
+					NRF24_KEEPALIVE_SEND_MS) > 0))
+			pending++;
+	}
+
+	return pending;
+}
+
+/*
+ * Data channel window is over: all peers are idle (nothing queued and
+ * nothing sent or received for RAW_HOLD) or the budget of the busy
+ * peers has been used.
+ */
+static bool raw_done(struct nrf24_adapter *adapter)
+{
+	uint32_t now = hal_time_ms();
+	uint8_t pending = raw_pending(adapter);
+
+	if (hal_timeout(now, adapter->running_start, RAW_IDLE_WINDOW +
+				pending * RAW_PEER_WINDOW) > 0)
+		return true;
+
+	return (pending == 0 &&
+		hal_timeout(now, adapter->running_start, RAW_IDLE_WINDOW) > 0 &&
+		hal_timeout(now, adapter->raw_activity, RAW_HOLD) > 0);
+}
+
+/* Peers waiting for a data pipe: see pipes_rotate() */
+static bool peers_parked(struct nrf24_adapter *adapter)
+{
+	uint8_t i;
+
+	for (i = 0; i < adapter->peers_max; i++) {
+		if (adapter->peers[i].pipe == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The data channel may only be left to scan/broadcast if there is room
+ * for a new peer or to hand the pipes over to parked peers.
+ */
+static bool raw_leave(struct nrf24_adapter *adapter)
+{
+	return (!peers_full(adapter) || peers_parked(adapter));
+}
+
+#ifndef ARDUINO
+/*
+ * Virtual pipes (NRF24_FLAG_VPIPE): more peers than data pipes. At the
+ * beginning of each data channel window, free pipes and the ones of
+ * idle peers are handed over to parked peers: peers with messages
+ * queued first, then round robin. Busy peers keep their pipe.
+ */
+static void pipes_rotate(struct nrf24_adapter *adapter)
+{
+	struct nrf24_data *peers = adapter->peers;
+	uint32_t now = hal_time_ms();
+	uint32_t parked = 0;
+	uint8_t i, pass, sockfd, bound = 0;
+	int pipe;
+
+	/* Peers parked by this rotation wait for the next one */
+	for (i = 0; i < adapter->peers_max; i++) {
+		if (peers[i].pipe == 0)
+			parked |= (uint32_t) 1 << i;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < adapter->peers_max; i++) {
+			sockfd = (adapter->vpipe_next + i) %
+						adapter->peers_max + 1;
+
+			if (peers[sockfd - 1].pipe != 0 ||
+					!(parked & ((uint32_t) 1 << (sockfd - 1))))
+				continue;
+
+			if (pass == 0 && !ring_count(&peers[sockfd - 1].tx_ring))
+				continue;
+
+			/* Free pipe or bound to an idle peer */
+			for (pipe = 1; pipe <= PIPE_COUNTER; pipe++) {
+				if (adapter->pipe_peer[pipe] == 0)
+					break;
+
+				if (CHK_BIT(bound, pipe) || peer_busy(&peers[
+					adapter->pipe_peer[pipe] - 1], now))
+					continue;
+
+				pipe_unbind(adapter, &peers[
+						adapter->pipe_peer[pipe] - 1]);
+				break;
+			}
+
+			/* All pipes busy */
+			if (pipe > PIPE_COUNTER)
+				return;
+
+			pipe_bind(adapter, sockfd, pipe);
+			SET_BIT(bound, pipe);
+
+			if (pass == 1)
+				adapter->vpipe_next = sockfd;
+		}
+	}
+}
+#else
+#define pipes_rotate(adapter)
+#endif
+
+static uint8_t rand_channel(uint8_t skip, uint8_t min, uint8_t max)
+{
+	uint8_t pick, range;
+	uint16_t rand_value = 0;
+
+	range = max - min;
+
+	/* Choose pseudo aleatory data channel */
+	do {
+		hal_getrandom(&rand_value, sizeof(rand_value));
+		pick = min + (rand_value % range);
+	} while (skip == pick);
+
+	return pick;
+}
+
+#ifndef ARDUINO
+/* Carrier seen on channel ch: busy ratio or SURVEY_UNUSABLE */
+static uint8_t survey_channel(struct nrf24_adapter *adapter, uint8_t ch)
+{
+	struct channel channel = { .value = ch, .ack = false };
+	uint8_t samples = SURVEY_SAMPLES;
+	int busy;
+
+	if (phy_ioctl(adapter->driver, NRF24_CMD_SET_CHANNEL, &channel) < 0)
+		return SURVEY_UNUSABLE;
+
+	busy = phy_ioctl(adapter->driver, NRF24_CMD_RPD, &samples);
+	if (busy < 0)
+		return SURVEY_UNUSABLE;
+
+	return busy * (SURVEY_UNUSABLE - 1) / SURVEY_SAMPLES;
+}
+
+/*
+ * Samples the next count channels. The radio is left on the last one:
+ * running() must set its channel again.
+ */
+static void survey_step(struct nrf24_adapter *adapter, uint8_t count)
+{
+	uint8_t ch, busy;
+
+	for (; count > 0; count--) {
+		ch = adapter->survey_next;
+		busy = survey_channel(adapter, ch);
+		if (busy != SURVEY_UNUSABLE)
+			busy = (adapter->survey_busy[ch] * 3 + busy) / 4;
+
+		adapter->survey_busy[ch] = busy;
+		adapter->survey_next = (ch + 1) % SURVEY_CHANNELS;
+	}
+
+	adapter->survey_start = hal_time_ms();
+}
+
+/*
+ * Quietest channel from min to max (excluded) apart from skip. Ties
+ * are broken randomly: gateways sharing the spectrum spread out.
+ */
+static uint8_t survey_pick(struct nrf24_adapter *adapter, uint8_t skip,
+						uint8_t min, uint8_t max)
+{
+	uint8_t i, ch, range = max - min, pick = skip;
+	uint8_t busy = SURVEY_UNUSABLE;
+	uint16_t rand_value = 0;
+
+	hal_getrandom(&rand_value, sizeof(rand_value));
+
+	for (i = 0; i < range; i++) {
+		ch = min + (rand_value + i) % range;
+		if (ch == skip || adapter->survey_busy[ch] >= busy)
+			continue;
+
+		busy = adapter->survey_busy[ch];
+		pick = ch;
+	}
+
+	/* Nothing usable has been seen */
+	if (pick == skip)
+		return rand_channel(skip, min, max);
+
+	return pick;
+}
+
+/* Connected peers other than sockfd? */
+static bool peers_linked(struct nrf24_adapter *adapter, int sockfd)
+{
+	uint8_t i;
+
+	for (i = 0; i < CONNECTION_COUNTER; i++) {
+		if (i != sockfd - 1 && adapter->peers[i].pipe >= 0 &&
+				adapter->peers[i].mac.address.uint64 != 0)
+			return true;
+	}
+
+	return false;
+}
+#endif
+
+/* Data channel: apart from the management one */
+static uint8_t raw_channel(struct nrf24_adapter *adapter)
+{
+	uint8_t min = (adapter->channel_mgmt.value < 84 ? 0 : 85);
+
+#ifndef ARDUINO
+	return survey_pick(adapter, adapter->channel_mgmt.value, min, 125);
+#else
+	return rand_channel(adapter->channel_mgmt.value, min, 125);
+#endif
+}
+
+static void running(struct nrf24_adapter *adapter)
+{
+	struct nrf24_data *peers = adapter->peers;
+	int sockIndex = adapter->sock_index;
+	int i, err;
+
+#ifndef ARDUINO
+	/* Expired links: disconnected by check_peer() */
+	hal_timer_run(&adapter->timers);
+#endif
+
+	switch (adapter->running_state) {
 	case START_MGMT:
 		/* Set channel to management channel */
-		phy_ioctl(driverIndex, NRF24_CMD_SET_CHANNEL, &channel_mgmt);
+		phy_ioctl(adapter->driver, NRF24_CMD_SET_CHANNEL,
+						&adapter->channel_mgmt);
 		/* Start timeout */
-		start = hal_time_ms();
+		adapter->running_start = hal_time_ms();
 		/* Go to next state */
-		running_state = MGMT;
+		adapter->running_state = MGMT;
 		break;
 	case MGMT:
 
-		read_mgmt(driverIndex);
-		write_mgmt(driverIndex);
+		read_mgmt(adapter);
+		write_mgmt(adapter);
 
 		/* Broadcasting/acceptor */
-		if (listen)
-			presence_connect(driverIndex);
+		if (adapter->listen)
+			presence_connect(adapter);
 
 		/* Peers connected? */
-		if (pipe_bitmask & PIPE_RAW_BITMASK) {
-			if (hal_timeout(hal_time_ms(), start, MGMT_TIMEOUT) > 0)
-				running_state = START_RAW;
+		if ((adapter->pipe_bitmask & PIPE_RAW_BITMASK) ||
+						peers_parked(adapter)) {
+			if (hal_timeout(hal_time_ms(), adapter->running_start,
+							MGMT_TIMEOUT) > 0)
+				adapter->running_state = START_RAW;
+		}
+#ifndef ARDUINO
+		/* Gateway without peers: survey the data channels */
+		else if (!adapter->listen && hal_timeout(hal_time_ms(),
+				adapter->survey_start, SURVEY_INTERVAL) > 0) {
+			survey_step(adapter, SURVEY_STEP);
+			adapter->running_state = START_MGMT;
 		}
+#endif
 		break;
 
 	case START_RAW:
+		/* Parked peers: select the ones bound to data pipes */
+		pipes_rotate(adapter);
+
 		/* Set channel to data channel */
-		phy_ioctl(driverIndex, NRF24_CMD_SET_CHANNEL, &channel_raw);
+		phy_ioctl(adapter->driver, NRF24_CMD_SET_CHANNEL,
+						&adapter->channel_raw);
 		/* Start timeout */
-		start = hal_time_ms();
+		adapter->running_start = hal_time_ms();
 
 		/* Go to next state */
-		running_state = RAW;
+		adapter->running_state = RAW;
 		break;
 	case RAW:
 
 		/* Start broadcast or scan? */
-#ifdef ARDUINO
-		if (!(pipe_bitmask & PIPE_RAW_BITMASK)) {
+		if (raw_leave(adapter) && raw_done(adapter)) {
+			/*
+			 * Leaving: switching channel flushes the RX FIFO,
+			 * drain it and don't start new transmissions.
+			 */
+			read_raw(adapter);
+			adapter->running_state = (peers_full(adapter) ?
+							START_RAW : START_MGMT);
+			break;
+		}
+
+		read_raw(adapter);
+
+		/* Keepalive slots: every live peer, busy or not */
+		for (i = 1; i <= CONNECTION_COUNTER; i++) {
+			if (peers[i - 1].pipe > 0)
+				check_peer(adapter, i);
+		}
+
+		/* Data slot: next peer (round robin) with messages queued */
+		for (i = 0; i < CONNECTION_COUNTER; i++) {
+			if (++sockIndex > CONNECTION_COUNTER)
+				sockIndex = 1;
+
+			if (peers[sockIndex - 1].pipe <= 0 ||
+				ring_count(&peers[sockIndex - 1].tx_ring) == 0)
+				continue;
+
+			/* Master: its data may ride on the ACKs of the slave */
+			if (peers[sockIndex - 1].keepalive != 0 &&
+				(peers[sockIndex - 1].opts &
+						NRF24_LL_OPT_ACK_PAYLOAD))
+				err = write_ack(adapter, sockIndex);
+			else
+				err = write_raw(adapter, sockIndex);
+
+			if (err >= 0)
+				adapter->raw_activity = hal_time_ms();
+
+			link_adapt(adapter, &peers[sockIndex - 1]);
+			break;
+		}
+
+		adapter->sock_index = sockIndex;
+
+		break;
+
+	}
+}
+
+/* Time (ms) remaining to timeout: zero if it has already expired */
+static int remaining_ms(uint32_t now, uint32_t start, uint32_t timeout)
+{
+	uint32_t elapsed = now - start;
+
+	return (elapsed >= timeout ? 0 : (int) (timeout - elapsed));
+}
+
+/* Smaller non negative value: -1 means no deadline */
+static int next_deadline(int deadline, int ms)
+{
+	return (deadline < 0 || ms < deadline ? ms : deadline);
+}
+
+/*
+ * Next time running() has work to do, assuming the radio IRQ reports
+ * incoming packets. Returns -1 if only incoming packets are expected.
+ */
+static int running_timeout(struct nrf24_adapter *adapter)
+{
+	struct nrf24_data *peers = adapter->peers;
+	uint32_t now = hal_time_ms();
+	int deadline = -1;
+	uint8_t i, pending;
+	int hold;
+#ifndef ARDUINO
+	int timer;
+#endif
+
+	switch (adapter->running_state) {
+	case START_MGMT:
+	case START_RAW:
+		return 0;
+	case MGMT:
+		if (ring_count(&adapter->mgmt.tx_ring))
+			return 0;
+
+		if (adapter->listen) {
+			switch (adapter->presence_connect_state) {
+			case BURST_WINDOW:
+				deadline = remaining_ms(now,
+						adapter->presence_start,
+						WINDOW_BCAST);
+				break;
+			case TIMEOUT_INTERVAL:
+				deadline = remaining_ms(now,
+						adapter->presence_start,
+						INTERVAL_BCAST);
+				break;
+			default:
+				return 0;
+			}
+		}
+
+		if ((adapter->pipe_bitmask & PIPE_RAW_BITMASK) ||
+						peers_parked(adapter))
+			deadline = next_deadline(deadline,
+					remaining_ms(now, adapter->running_start,
+							MGMT_TIMEOUT));
+#ifndef ARDUINO
+		else if (!adapter->listen)
+			deadline = next_deadline(deadline,
+					remaining_ms(now, adapter->survey_start,
+							SURVEY_INTERVAL));
+#endif
+		break;
+	case RAW:
+		/* End of window: see raw_done() */
+		if (raw_leave(adapter)) {
+			pending = raw_pending(adapter);
+			deadline = remaining_ms(now, adapter->running_start,
+					RAW_IDLE_WINDOW + pending * RAW_PEER_WINDOW);
+			hold = remaining_ms(now, adapter->raw_activity, RAW_HOLD);
+			if (pending == 0 && hold > deadline)
+				deadline = hold;
+		}
+
+		/* Live peers: parked ones wait for pipes_rotate() */
+		for (i = 0; i < CONNECTION_COUNTER; i++) {
+			if (peers[i].pipe <= 0)
+				continue;
+
+			if (ring_count(&peers[i].tx_ring))
+				return 0;
+
+#ifndef ARDUINO
+			/* Expired: check_peer() disconnects it */
+			if (peers[i].link_lost)
+				return 0;
 #else
-		if ((pipe_bitmask & PIPE_RAW_BITMASK) != PIPE_RAW_BITMASK) {
+			deadline = next_deadline(deadline,
+					remaining_ms(now,
+						peers[i].keepalive_anchor,
+						NRF24_KEEPALIVE_TIMEOUT_MS));
+#endif
+
+			if (peers[i].keepalive == 0)
+				continue;
+
+			deadline = next_deadline(deadline,
+					remaining_ms(now,
+						peers[i].keepalive_anchor,
+						peers[i].keepalive *
+						NRF24_KEEPALIVE_SEND_MS));
+		}
+
+#ifndef ARDUINO
+		/* Keepalive timeouts: earliest link timer */
+		timer = hal_timer_next(&adapter->timers);
+		if (timer >= 0)
+			deadline = next_deadline(deadline, timer);
+#endif
+		break;
+	}
+
+	return deadline;
+}
+
+/* Reset adapter context: no peers and machine states at initial state */
+static void adapter_reset(struct nrf24_adapter *adapter)
+{
+	uint8_t i;
+
+	memset(adapter, 0, sizeof(*adapter));
+	adapter->driver = -1;
+	adapter->irq_fd = -1;
+#ifndef ARDUINO
+	adapter->wake_fd = -1;
+#endif
+
+#ifndef ARDUINO
+	hal_timer_wheel_init(&adapter->timers);
+#endif
+
+	/* Clear all peers*/
+	for (i = 0; i < CONNECTION_COUNTER; i++) {
+		adapter->peers[i].pipe = -1;
+		ring_init(&adapter->peers[i].rx_ring, NRF24_RX_QUEUE);
+		ring_init(&adapter->peers[i].tx_ring, NRF24_TX_QUEUE);
+	}
+
+	adapter->tx_slots = NRF24_TX_QUEUE;
+	adapter->rx_slots = NRF24_RX_QUEUE;
+	adapter->peers_max = PIPE_COUNTER;
+
+	adapter->msg_size = msg_size(NRF24_MSG_SIZE);
+	pool_init(&adapter->tx_pool);
+	pool_init(&adapter->rx_pool);
+
+	adapter->mgmt.pipe = -1;
+	ring_init(&adapter->mgmt.evt_ring, MGMT_EVT_SLOTS);
+	ring_init(&adapter->mgmt.presence_ring, MGMT_PRESENCE_SLOTS);
+	adapter->mgmt.evt_dropped = 0;
+	ring_init(&adapter->mgmt.tx_ring, MGMT_SLOTS);
+#ifndef ARDUINO
+	adapter->mgmt.rsp_len = 0;
+#endif
+	adapter->pipe_bitmask = PIPE_BITMASK_DEFAULT;
+
+	adapter->channel_mgmt.value = 76;
+	adapter->channel_mgmt.ack = false;
+	adapter->channel_raw.value = 22;
+	adapter->channel_raw.ack = true;
+
+	/* Reset machine states */
+	adapter->running_state = START_MGMT;
+	adapter->sock_index = 1;
+	adapter->presence_connect_state = PRESENCE;
+	adapter->previous_state = TIMEOUT_INTERVAL;
+}
+
+/* Returns the adapter addressed by the 4 MSB of sockfd if opened */
+static struct nrf24_adapter *get_adapter(int sockfd)
+{
+	int index;
+
+	if (sockfd < 0)
+		return NULL;
+
+	index = HAL_COMM_ADAPTER_INDEX(sockfd);
+	if (index >= ADAPTER_COUNTER || adapters[index].driver == -1)
+		return NULL;
+
+	return &adapters[index];
+}
+
+#ifndef ARDUINO
+/* Queue slots: power of two not lower than len */
+static uint8_t queue_slots(uint8_t len)
+{
+	uint8_t slots = 1;
+
+	while (slots < len && slots < QUEUE_MAX)
+		slots <<= 1;
+
+	return slots;
+}
+#endif
+
+/* Serializes control operations and the engine thread */
+static inline void adapter_lock(struct nrf24_adapter *adapter)
+{
+#ifndef ARDUINO
+	pthread_mutex_lock(&adapter->lock);
+#endif
+}
+
+static inline void adapter_unlock(struct nrf24_adapter *adapter)
+{
+#ifndef ARDUINO
+	pthread_mutex_unlock(&adapter->lock);
 #endif
-			/*Checks for RAW timeout and RTs offset time*/
-			if (hal_timeout(hal_time_ms(), start, raw_timeout) > 0 &&
-			hal_timeout(hal_time_ms(), rt_stamp, (rt_offset)) > 0)
-				running_state = START_MGMT;
-		}
+}
 
-		read_raw(driverIndex);
+/* Runs background procedures unless the engine thread owns them */
+static void adapter_run(struct nrf24_adapter *adapter)
+{
+#ifndef ARDUINO
+	if (adapter->wake_fd >= 0)
+		return;
+#endif
+	running(adapter);
+}
 
-		/* Check if pipe is allocated */
-		if (peers[sockIndex-1].pipe != -1) {
-			write_raw(driverIndex, sockIndex);
-			rt_stamp = hal_time_ms();
+/* Engine thread: new message to send or control operation */
+static void engine_wakeup(struct nrf24_adapter *adapter)
+{
+#ifndef ARDUINO
+	uint64_t value = 1;
 
-			/*
-			 * If keepalive is enabled
-			 * Check if timeout occurred and generates
-			 * disconnect event
-			 */
+	if (adapter->wake_fd >= 0 &&
+			write(adapter->wake_fd, &value, sizeof(value)) < 0)
+		hal_log_error("nrf24: engine wakeup: %s", strerror(errno));
+#endif
+}
 
-			if (check_keepalive(driverIndex, sockIndex) == -ETIMEDOUT &&
-				mgmt.len_rx == 0) {
+#ifndef ARDUINO
+static void *engine_thread(void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+	struct pollfd pfd[2];
+	uint64_t value;
+	int timeout;
+
+	/* Negative fd (no IRQ) is ignored by poll */
+	pfd[0].fd = adapter->wake_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = adapter->irq_fd;
+	pfd[1].events = hal_gpio_poll_events();
+
+	while (!__atomic_load_n(&adapter->engine_stop, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&adapter->lock);
+		running(adapter);
+		timeout = running_timeout(adapter);
+		pthread_mutex_unlock(&adapter->lock);
+
+		if (timeout == 0)
+			continue;
 
-				mgmtev_hdr = (struct mgmt_nrf24_header *)
-								mgmt.buffer_rx;
-				mgmtev_dc = (struct mgmt_evt_nrf24_disconnected *)
-							mgmtev_hdr->payload;
+		/* Without IRQ incoming packets must be polled */
+		if (adapter->irq_fd < 0) {
+			usleep(ENGINE_POLL_US);
+			continue;
+		}
 
-				mgmtev_hdr->opcode = MGMT_EVT_NRF24_DISCONNECTED;
+		if (poll(pfd, 2, timeout) > 0 && (pfd[0].revents & POLLIN) &&
+			read(adapter->wake_fd, &value, sizeof(value)) < 0)
+			hal_log_error("nrf24: engine: %s", strerror(errno));
+	}
 
-				mgmtev_dc->mac.address.uint64 =
-					peers[sockIndex-1].mac.address.uint64;
-				mgmt.len_rx = sizeof(*mgmtev_hdr) +
-								sizeof(*mgmtev_dc);
-
-				/* TODO: Send disconnect packet to slave */
-
-				/* Free pipe & resize raw time */
-				CLR_BIT(pipe_bitmask, peers[sockIndex - 1].pipe);
-				peers[sockIndex - 1].pipe = -1;
-				peers[sockIndex - 1].keepalive = 0;
-				phy_ioctl(driverIndex, NRF24_CMD_RESET_PIPE,
-								&sockIndex);
-				raw_timeout = new_raw_time();
-			}
-		}
+	return NULL;
+}
 
-		sockIndex++;
-		/* Resets sockIndex if sockIndex > CONNECTION_COUNTER */
-		if (sockIndex > CONNECTION_COUNTER)
-			sockIndex = 1;
+static int engine_start(struct nrf24_adapter *adapter)
+{
+	int err;
 
-		break;
+	adapter->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (adapter->wake_fd < 0)
+		return -errno;
 
+	adapter->engine_stop = 0;
+	err = pthread_create(&adapter->engine, NULL, engine_thread, adapter);
+	if (err != 0) {
+		close(adapter->wake_fd);
+		adapter->wake_fd = -1;
+		return -err;
 	}
+
+	return 0;
 }
 
-static uint8_t rand_channel(uint8_t skip, uint8_t min, uint8_t max)
+static void engine_stop(struct nrf24_adapter *adapter)
 {
-	uint8_t pick, range;
-	uint16_t rand_value = 0;
-
-	range = max - min;
+	if (adapter->wake_fd < 0)
+		return;
 
-	/* Choose pseudo aleatory data channel */
-	do {
-		hal_getrandom(&rand_value, sizeof(rand_value));
-		pick = min + (rand_value % range);
-	} while (skip == pick);
+	__atomic_store_n(&adapter->engine_stop, 1, __ATOMIC_RELEASE);
+	engine_wakeup(adapter);
+	pthread_join(adapter->engine, NULL);
 
-	return pick;
+	close(adapter->wake_fd);
+	adapter->wake_fd = -1;
 }
+#endif
 
 /* Global functions */
 int hal_comm_init(const char *pathname, const void *params)
 {
-	uint8_t min;
+	struct nrf24_adapter *adapter;
+	const struct nrf24_config *config;
+	bool enable;
+	int driver;
+#ifndef ARDUINO
+	int err;
+#endif
+
+	/* Open driver and returns the driver index */
+	driver = phy_open(pathname);
+	if (driver < 0)
+		return driver;
 
-	/* If driver not opened */
-	if (driverIndex != -1)
+	/* If driver has no adapter or is already opened */
+	if (driver >= ADAPTER_COUNTER || adapters[driver].driver != -1) {
+		phy_close(driver);
 		return -EPERM;
+	}
 
-	/* Open driver and returns the driver index */
-	driverIndex = phy_open(pathname);
-	if (driverIndex < 0)
-		return driverIndex;
+	adapter = &adapters[driver];
+	adapter_reset(adapter);
+	adapter->driver = driver;
 
 	config = (const struct nrf24_config *) params;
-	mac_local.address.uint64 = config->mac.address.uint64;
+	adapter->config = config;
+	adapter->mac_local.address.uint64 = config->mac.address.uint64;
 
 	/* Change default broadcasting channel */
 	if (config->channel > 0)
-		channel_mgmt.value = config->channel;
+		adapter->channel_mgmt.value = config->channel;
+
+#ifndef ARDUINO
+	/* Every channel once before picking the data channel */
+	memset(adapter->survey_busy, 0, sizeof(adapter->survey_busy));
+	adapter->survey_next = 0;
+	survey_step(adapter, SURVEY_CHANNELS);
+#endif
+	adapter->channel_raw.value = raw_channel(adapter);
 
-	min = (channel_mgmt.value < 84 ? 0 : 85);
-	channel_raw.value = rand_channel(channel_mgmt.value, min, 125);
+	/* IRQ driven radio: falls back to polling if not available */
+	if (config->flags & NRF24_FLAG_IRQ) {
+		adapter->irq_fd = phy_ioctl(driver, NRF24_CMD_SET_IRQ, NULL);
+		if (adapter->irq_fd < 0)
+			adapter->irq_fd = -1;
+	}
+
+	/* Payloads on ACKs: each link negotiates it */
+	if (config->flags & NRF24_FLAG_ACK_PAYLOAD) {
+		enable = true;
+		phy_ioctl(driver, NRF24_CMD_SET_ACK_PAYLOAD, &enable);
+	}
+
+#ifndef ARDUINO
+	adapter->presence_filter = 1;
+	adapter->presence_window = (config->presence_window > 0 ?
+				config->presence_window : PRESENCE_WINDOW);
+
+	/* Transmit and receive queues of each peer */
+	if (config->tx_queue > 0)
+		adapter->tx_slots = queue_slots(config->tx_queue);
+
+	if (config->rx_queue > 0)
+		adapter->rx_slots = queue_slots(config->rx_queue);
+
+	/* Large messages: up to the chunk pool */
+	if (config->msg_size > 0)
+		adapter->msg_size = msg_size(config->msg_size);
+
+	/* More peers than data pipes: see pipes_rotate() */
+	if (config->flags & NRF24_FLAG_VPIPE)
+		adapter->peers_max = CONNECTION_COUNTER;
+
+	adapter->tx_msgs = calloc(CONNECTION_COUNTER * adapter->tx_slots,
+						sizeof(*adapter->tx_msgs));
+	adapter->rx_msgs = calloc(CONNECTION_COUNTER * adapter->rx_slots,
+						sizeof(*adapter->rx_msgs));
+	if (adapter->tx_msgs == NULL || adapter->rx_msgs == NULL) {
+		free(adapter->tx_msgs);
+		free(adapter->rx_msgs);
+		phy_close(driver);
+		adapter_reset(adapter);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&adapter->lock, NULL);
+
+	if (config->flags & NRF24_FLAG_THREAD) {
+		err = engine_start(adapter);
+		if (err < 0) {
+			pthread_mutex_destroy(&adapter->lock);
+			free(adapter->tx_msgs);
+			free(adapter->rx_msgs);
+			phy_close(driver);
+			adapter_reset(adapter);
+			return err;
+		}
+	}
+
+	/* Not fatal: debug records are written inline otherwise */
+	if ((config->flags & NRF24_FLAG_LOG_ASYNC) &&
+					hal_log_async_start() == 0)
+		adapter->log_async = 1;
+#endif
 
 	return 0;
 }
 
 int hal_comm_deinit(void)
 {
-	int err;
+	int err = -EPERM;
 	uint8_t i;
 
-	/* If try to close driver with no driver open */
-	if (driverIndex == -1)
-		return -EPERM;
-
-	/* Close driver */
-	err = phy_close(driverIndex);
-	if (err < 0)
-		return err;
+	for (i = 0; i < ADAPTER_COUNTER; i++) {
+		/* If try to close driver with no driver open */
+		if (adapters[i].driver == -1)
+			continue;
 
-	/* Dereferencing driverIndex */
-	driverIndex = -1;
+#ifndef ARDUINO
+		engine_stop(&adapters[i]);
 
-	/* Clear all peers*/
-	memset(peers, 0, sizeof(peers));
-	for (i = 0; i < CONNECTION_COUNTER; i++) {
-		peers[i].pipe = -1;
-	}
+		/* Flushes the debug records still queued */
+		if (adapters[i].log_async)
+			hal_log_async_stop();
+#endif
 
-	memset(&mgmt, 0, sizeof(mgmt));
-	mgmt.pipe = -1;
+		/* Close driver */
+		err = phy_close(adapters[i].driver);
+		if (err < 0)
+			return err;
 
-	pipe_bitmask = 0b00000001;
+#ifndef ARDUINO
+		pthread_mutex_destroy(&adapters[i].lock);
+		free(adapters[i].tx_msgs);
+		free(adapters[i].rx_msgs);
+#endif
 
-	/* Reset machine states */
-	running_state = START_MGMT;
-	presence_connect_state = PRESENCE;
-	previous_state = TIMEOUT_INTERVAL;
+		/* Dereferencing driver index, clear peers and states */
+		adapter_reset(&adapters[i]);
+	}
 
 	return err;
 }
 
-int hal_comm_socket(int domain, int protocol)
+static int socket_open(struct nrf24_adapter *adapter, int protocol)
 {
 	int retval;
 	struct addr_pipe ap;
 
-	/* If domain is not NRF24 */
-	if (domain != HAL_COMM_PF_NRF24)
-		return -EPERM;
-
-	/* If not initialized */
-	if (driverIndex == -1)
-		return -EPERM;	/* Operation not permitted */
-
 	switch (protocol) {
 
 	case HAL_COMM_PROTO_MGMT:
 		/* If Management, disable ACK and returns 0 */
-		if (mgmt.pipe == 0)
+		if (adapter->mgmt.pipe == 0)
 			return -EUSERS; /* Returns too many users */
 		retval = 0;
-		mgmt.pipe = 0;
+		adapter->mgmt.pipe = 0;
 
 		/* Copy broadcast address */
 		memcpy(ap.aa, aa_pipe0, sizeof(ap.aa));
 		break;
 
 	case HAL_COMM_PROTO_RAW:
-		if (mgmt.pipe == -1) {
+		if (adapter->mgmt.pipe == -1) {
 			/* If Management is not open*/
-			mgmt.pipe = 0;
+			adapter->mgmt.pipe = 0;
 			retval = 0;
 			/* Copy broadcast address */
 			memcpy(ap.aa, aa_pipe0, sizeof(ap.aa));
 			break;
 		}
 		/*
-		 * If raw data, enable ACK
-		 * and returns an available pipe
-		 * from 1 to 5
+		 * If raw data, enable ACK and returns an available
+		 * peer: bound to a pipe from 1 to 5 or parked
 		 */
-		retval = alloc_pipe();
+		retval = alloc_pipe(adapter, NULL);
 		/* If not pipe available */
 		if (retval < 0)
 			return -EUSERS; /* Returns too many users */
 
-		/*
-		 * Copy the 5 LSBs of master mac addres
-		 * to access address and the last least
-		 * significant byte is the pipe index.
-		 */
-		memcpy(ap.aa, &mac_local.address.b[3], sizeof(ap.aa));
-		ap.aa[0] = (uint8_t)retval;
-
-		break;
+		return retval;
 
 	default:
 		return -EINVAL; /* Invalid argument */
@@ -1053,152 +2828,343 @@ int hal_comm_socket(int domain, int protocol)
 	ap.pipe = retval;
 
 	/* Open pipe */
-	phy_ioctl(driverIndex, NRF24_CMD_SET_PIPE, &ap);
+	phy_ioctl(adapter->driver, NRF24_CMD_SET_PIPE, &ap);
 
 	return retval;
 }
 
+int hal_comm_socket(int domain, int protocol)
+{
+	struct nrf24_adapter *adapter;
+	int retval;
+
+	/* If domain is not NRF24 */
+	if (HAL_COMM_CHANNEL(domain) != HAL_COMM_PF_NRF24)
+		return -EPERM;
+
+	/* If not initialized */
+	adapter = get_adapter(domain);
+	if (adapter == NULL)
+		return -EPERM;	/* Operation not permitted */
+
+	adapter_lock(adapter);
+	retval = socket_open(adapter, protocol);
+	adapter_unlock(adapter);
+
+	if (retval < 0)
+		return retval;
+
+	return HAL_COMM_ADAPTER(adapter - adapters) | retval;
+}
+
 int hal_comm_close(int sockfd)
 {
-	if (driverIndex == -1)
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+	struct nrf24_data *peers;
+
+	if (adapter == NULL)
 		return -EPERM;
 
+	peers = adapter->peers;
+	sockfd = HAL_COMM_CHANNEL(sockfd);
+
+	adapter_lock(adapter);
+
 	/* Pipe 0 is not closed because ACK arrives in this pipe */
-	if (sockfd >= 1 && sockfd <= 5 && peers[sockfd-1].pipe != -1) {
-		/* Send disconnect packet */
-		if (mac_local.address.uint64 != 0)
+	if (sockfd >= 1 && sockfd <= CONNECTION_COUNTER &&
+					peers[sockfd-1].pipe != -1) {
+		/* Send disconnect packet: parked peers are not reachable */
+		if (adapter->mac_local.address.uint64 != 0 &&
+						peers[sockfd-1].pipe > 0)
 			/* Slave side */
-			write_disconnect(driverIndex, sockfd,
-					&peers[sockfd-1].mac, &mac_local);
-		/* Free pipe & & resize raw time */
-		CLR_BIT(pipe_bitmask, peers[sockfd - 1].pipe);
+			write_disconnect(adapter, sockfd,
+					&peers[sockfd-1].mac, &adapter->mac_local);
+		/* Free pipe */
+		pipe_unbind(adapter, &peers[sockfd - 1]);
 		peers[sockfd-1].pipe = -1;
-		phy_ioctl(driverIndex, NRF24_CMD_RESET_PIPE, &sockfd);
-		raw_timeout = new_raw_time();
 		/* Disable to send keep alive request */
 		peers[sockfd-1].keepalive = 0;
+#ifndef ARDUINO
+		hal_timer_cancel(&adapter->timers, &peers[sockfd-1].link_timer);
+#endif
 	}
 
+	/* Queued messages: their chunks are shared by all peers */
+	if (sockfd >= 1 && sockfd <= CONNECTION_COUNTER)
+		peer_release(adapter, sockfd, true);
+
+	adapter_unlock(adapter);
+
 	return 0;
 }
 
 ssize_t hal_comm_read(int sockfd, void *buffer, size_t count)
 {
-	size_t length = 0;
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+	struct nrf24_data *peers;
+	struct data_msg *msg;
+	size_t length = 0, len;
+	uint8_t tail, chunk;
+	int slot;
+
+	if (adapter == NULL)
+		return -EINVAL;
 
 	/* Run background procedures */
-	running();
+	adapter_run(adapter);
+
+	peers = adapter->peers;
+	sockfd = HAL_COMM_CHANNEL(sockfd);
 
-	if (sockfd < 0 || sockfd > 5 || count == 0)
+	if (sockfd > CONNECTION_COUNTER || count == 0)
 		return -EINVAL;
 
-	/* If management */
+	/* If management: one event per call, connect/disconnect first */
 	if (sockfd == 0) {
-		/* If has something to read */
-		if (mgmt.len_rx != 0) {
+#ifndef ARDUINO
+		/* Response of the last command written */
+		if (adapter->mgmt.rsp_len) {
+			length = _MIN(adapter->mgmt.rsp_len, count);
+			memcpy(buffer, adapter->mgmt.rsp, length);
+			adapter->mgmt.rsp_len = 0;
+			return length;
+		}
+#endif
+
+		slot = ring_peek_read(&adapter->mgmt.evt_ring);
+		if (slot >= 0) {
 			/*
 			 * If the amount of bytes available
 			 * to be read is greather than count
 			 * then read count bytes
 			 */
-			length = mgmt.len_rx > count ? count : mgmt.len_rx;
-			/* Copy rx buffer */
-			memcpy(buffer, mgmt.buffer_rx, length);
+			length = _MIN(adapter->mgmt.evt[slot].len, count);
+			/* Copy rx message */
+			memcpy(buffer, adapter->mgmt.evt[slot].data, length);
 
-			/* Reset rx len */
-			mgmt.len_rx = 0;
-		} else /* Return -EAGAIN has nothing to be read */
-			return -EAGAIN;
+			/* Release rx slot */
+			ring_commit_read(&adapter->mgmt.evt_ring);
+			return length;
+		}
 
-	} else if (peers[sockfd-1].len_rx != 0) {
-		/*
-		 * If the amount of bytes available
-		 * to be read is greather than count
-		 * then read count bytes
-		 */
-		length = peers[sockfd-1].len_rx > count ?
-				 count : peers[sockfd-1].len_rx;
-		/* Copy rx buffer */
-		memcpy(buffer, peers[sockfd-1].buffer_rx, length);
-		/* Reset rx len */
-		peers[sockfd-1].len_rx = 0;
-	} else
-		return -EAGAIN;
+		/* Oldest presence may be dropped while it is copied: retry */
+		do {
+			slot = ring_peek_read_tail(&adapter->mgmt.presence_ring,
+									&tail);
+			if (slot < 0) /* Nothing to be read */
+				return -EAGAIN;
+
+			length = _MIN(adapter->mgmt.presence[slot].len, count);
+			memcpy(buffer, adapter->mgmt.presence[slot].data,
+								length);
+		} while (!ring_commit_read_tail(&adapter->mgmt.presence_ring,
+									tail));
+	} else {
+		/* Oldest message may be dropped while it is copied: retry */
+		do {
+			slot = ring_peek_read_tail(&peers[sockfd-1].rx_ring,
+									&tail);
+			if (slot < 0)
+				return -EAGAIN;
+
+			msg = rx_msg(adapter, sockfd, slot);
+			len = msg->len;
+			chunk = msg->chunk;
+
+			/*
+			 * If the amount of bytes available
+			 * to be read is greather than count
+			 * then read count bytes
+			 */
+			length = _MIN(len, count);
+			/* Copy rx message */
+			chunk_read(&adapter->rx_pool, chunk, buffer, length);
+			/* Release rx slot */
+		} while (!ring_commit_read_tail(&peers[sockfd-1].rx_ring,
+								tail));
+
+		/* Read: its chunks are free again */
+		chunk_free(&adapter->rx_pool, chunk, MSG_CHUNKS(len));
+	}
 
 	/* Returns the amount of bytes read */
 	return length;
 }
 
+#ifndef ARDUINO
+/*
+ * Response of MGMT_CMD_NRF24_LINK_STATS: the counters of the peer
+ * connected to 'mac', copied under the lock (engine thread).
+ */
+static void link_stats_rsp(struct nrf24_adapter *adapter,
+				const struct nrf24_mac *mac)
+{
+	struct mgmt_nrf24_header *mgmtrsp_hdr;
+	struct mgmt_cmd_nrf24_rsp *rsp;
+	struct nrf24_link_stats *stats;
+	struct nrf24_data *peer;
+	int i;
+
+	mgmtrsp_hdr = (struct mgmt_nrf24_header *) adapter->mgmt.rsp;
+	rsp = (struct mgmt_cmd_nrf24_rsp *) mgmtrsp_hdr->payload;
+	stats = (struct nrf24_link_stats *) rsp->payload;
+
+	mgmtrsp_hdr->opcode = MGMT_CMD_NRF24_RSP;
+	mgmtrsp_hdr->index = adapter - adapters;
+	rsp->cmd = MGMT_CMD_NRF24_LINK_STATS;
+	rsp->status = 1;
+	rsp->len = 0;
+
+	adapter_lock(adapter);
+	for (i = 0; i < CONNECTION_COUNTER; i++) {
+		peer = &adapter->peers[i];
+		if (peer->pipe < 0 ||
+			peer->mac.address.uint64 != mac->address.uint64)
+			continue;
+
+		memcpy(stats, &peer->stats, sizeof(*stats));
+		stats->rx_dropped = peer->rx_dropped;
+		rsp->status = 0;
+		rsp->len = sizeof(*stats);
+		break;
+	}
+	adapter_unlock(adapter);
+
+	adapter->mgmt.rsp_len = sizeof(*mgmtrsp_hdr) + sizeof(*rsp) + rsp->len;
+}
+
+/* Synchronous commands written to the management socket */
+static ssize_t write_mgmt_cmd(struct nrf24_adapter *adapter,
+					const void *buffer, size_t count)
+{
+	const struct mgmt_nrf24_header *mgmtcmd_hdr = buffer;
+	const struct mgmt_cmd_nrf24_scan_params *scan;
+	const struct mgmt_cmd_nrf24_link_stats *link;
+	struct nrf24_mac mac;
+
+	if (count < sizeof(*mgmtcmd_hdr))
+		return -EINVAL;
+
+	switch (mgmtcmd_hdr->opcode) {
+	case MGMT_CMD_NRF24_SCAN_PARAMS:
+		if (count < sizeof(*mgmtcmd_hdr) + sizeof(*scan))
+			return -EINVAL;
+
+		scan = (const struct mgmt_cmd_nrf24_scan_params *)
+							mgmtcmd_hdr->payload;
+
+		adapter_lock(adapter);
+		/* Enabling: report every device once again */
+		if (scan->filter && !adapter->presence_filter)
+			memset(adapter->presence_cache, 0,
+					sizeof(adapter->presence_cache));
+		adapter->presence_filter = scan->filter;
+		adapter_unlock(adapter);
+		break;
+	case MGMT_CMD_NRF24_LINK_STATS:
+		if (count < sizeof(*mgmtcmd_hdr) + sizeof(*link))
+			return -EINVAL;
+
+		/* Packed: the mac may be unaligned */
+		link = (const struct mgmt_cmd_nrf24_link_stats *)
+							mgmtcmd_hdr->payload;
+		mac.address.uint64 = link->mac.address.uint64;
+		link_stats_rsp(adapter, &mac);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return count;
+}
+#endif
+
 ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count)
 {
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+	struct nrf24_data *peers;
+	struct data_msg *msg;
+	int slot;
+
+	if (adapter == NULL)
+		return -EINVAL;
 
 	/* Run background procedures */
-	running();
+	adapter_run(adapter);
+
+	peers = adapter->peers;
+	sockfd = HAL_COMM_CHANNEL(sockfd);
 
-	if (sockfd < 1 || sockfd > 5 || count == 0 || count > DATA_SIZE)
+#ifndef ARDUINO
+	if (sockfd == 0)
+		return write_mgmt_cmd(adapter, buffer, count);
+#endif
+
+	if (sockfd < 1 || sockfd > CONNECTION_COUNTER || count == 0 ||
+						count > adapter->msg_size)
 		return -EINVAL;
 
-	/* If already has something to write then returns busy */
-	if (peers[sockfd-1].len_tx != 0)
+	/* Closed or never opened: queued chunks would never be freed */
+	if (peers[sockfd-1].pipe == -1)
+		return -ENOTCONN;
+
+	/*
+	 * If the transmit queue or the pool is full then returns busy.
+	 * Only this side takes chunks: free ones remain available.
+	 */
+	slot = ring_peek_write(&peers[sockfd-1].tx_ring);
+	if (slot < 0 || ring_count(&adapter->tx_pool.free_ring) <
+							MSG_CHUNKS(count))
 		return -EBUSY;
 
-	/* Copy data to be write in tx buffer */
-	memcpy(peers[sockfd-1].buffer_tx, buffer, count);
-	peers[sockfd-1].len_tx = count;
+	/* Copy data to be write in tx slot */
+	msg = tx_msg(adapter, sockfd, slot);
+	msg->chunk = chunk_chain(&adapter->tx_pool, MSG_CHUNKS(count));
+	chunk_write(&adapter->tx_pool, msg->chunk, buffer, count);
+	msg->len = count;
+	ring_commit_write(&peers[sockfd-1].tx_ring);
+
+	engine_wakeup(adapter);
 
 	return count;
 }
 
 int hal_comm_listen(int sockfd)
 {
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+
+	if (adapter == NULL)
+		return -EPERM;
+
+	adapter_lock(adapter);
+
 	/* Init listen */
-	listen = 1;
+	adapter->listen = 1;
 
 	/* pipe0 used for broadcasting/scanning */
-	SET_BIT(pipe_bitmask, 0);
+	SET_BIT(adapter->pipe_bitmask, 0);
+
+	adapter_unlock(adapter);
+
+	engine_wakeup(adapter);
 
 	return 0;
 }
 
-int hal_comm_accept(int sockfd, void *addr)
+static int accept_peer(struct nrf24_adapter *adapter,
+			const struct mgmt_evt_nrf24_connected *mgmtev_cn)
 {
-	struct nrf24_mac *mac = (struct nrf24_mac *) addr;
-
-	/* TODO: Run background procedures */
-	struct mgmt_nrf24_header *mgmtev_hdr =
-				(struct mgmt_nrf24_header *) mgmt.buffer_rx;
-	struct mgmt_evt_nrf24_connected *mgmtev_cn =
-			(struct mgmt_evt_nrf24_connected *)mgmtev_hdr->payload;
-	struct addr_pipe p_addr;
+	struct nrf24_data *peers = adapter->peers;
 	int pipe;
-	/* Run background procedures */
-	running();
-
-	if (mgmt.len_rx == 0)
-		return -EAGAIN;
-
-	/* Free management read to receive new packet */
-	mgmt.len_rx = 0;
 
-	if (mgmtev_hdr->opcode != MGMT_EVT_NRF24_CONNECTED ||
-		mgmtev_cn->dst.address.uint64 != mac_local.address.uint64)
-		return -EAGAIN;
-
-	pipe = alloc_pipe();
+	/* Set aa in pipe */
+	pipe = alloc_pipe(adapter, mgmtev_cn->aa);
 	/* If not pipe available */
 	if (pipe < 0)
 		return -EUSERS; /* Returns too many users */
 
 	/* If accept then stop listen */
-	listen = 0;
-
-	/* Set aa in pipe */
-	p_addr.pipe = pipe;
-	memcpy(p_addr.aa, mgmtev_cn->aa, sizeof(p_addr.aa));
-	/*open pipe*/
-	phy_ioctl(driverIndex, NRF24_CMD_SET_PIPE, &p_addr);
-	/*Resize data channel time*/
-	raw_timeout = new_raw_time();
+	adapter->listen = 0;
 
 	/* Source address for keepalive message */
 	peers[pipe-1].mac.address.uint64 =
@@ -1206,69 +3172,190 @@ int hal_comm_accept(int sockfd, void *addr)
 	/* Disable keep alive request */
 	peers[pipe-1].keepalive = 0;
 	/* Start timeout */
-	peers[pipe-1].keepalive_anchor = hal_time_ms();
+	keepalive_restart(adapter, &peers[pipe-1]);
 
-	/* Copy peer address */
-	mac->address.uint64 = mgmtev_cn->src.address.uint64;
+	/* Masters running an older link layer offer no option */
+	peers[pipe-1].opts = mgmtev_cn->opts & NRF24_LL_OPT_MSGID;
+
+	/* Gateway data on ACKs: received on pipe 0 while PTX */
+	if ((mgmtev_cn->opts & NRF24_LL_OPT_ACK_PAYLOAD) &&
+			(adapter->config->flags & NRF24_FLAG_ACK_PAYLOAD) &&
+			adapter->pipe_peer[0] == 0) {
+		peers[pipe-1].opts |= NRF24_LL_OPT_ACK_PAYLOAD;
+		adapter->pipe_peer[0] = pipe;
+	}
+
+	if (peers[pipe-1].opts)
+		peers[pipe-1].opts |= OPTS_CONFIRM;
 
 	/* Store channel informed by the peer */
-	channel_raw.value = mgmtev_cn->channel;
+	adapter->channel_raw.value = mgmtev_cn->channel;
 
-	/* Return pipe */
 	return pipe;
 }
 
+int hal_comm_accept(int sockfd, void *addr)
+{
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+	struct nrf24_mac *mac = (struct nrf24_mac *) addr;
+	struct mgmt_nrf24_header *mgmtev_hdr;
+	struct mgmt_evt_nrf24_connected *mgmtev_cn;
+	uint8_t evt[MGMT_SIZE];
+	int pipe, slot;
+
+	if (adapter == NULL)
+		return -EPERM;
+
+	/* Run background procedures */
+	adapter_run(adapter);
+
+	/* Presence events are left to hal_comm_read() */
+	slot = ring_peek_read(&adapter->mgmt.evt_ring);
+	if (slot < 0)
+		return -EAGAIN;
+
+	/* Copy the event and free its slot to receive new packet */
+	memcpy(evt, adapter->mgmt.evt[slot].data, sizeof(evt));
+	ring_commit_read(&adapter->mgmt.evt_ring);
+
+	mgmtev_hdr = (struct mgmt_nrf24_header *) evt;
+	mgmtev_cn = (struct mgmt_evt_nrf24_connected *) mgmtev_hdr->payload;
+
+	if (mgmtev_hdr->opcode != MGMT_EVT_NRF24_CONNECTED ||
+		mgmtev_cn->dst.address.uint64 !=
+				adapter->mac_local.address.uint64)
+		return -EAGAIN;
+
+	adapter_lock(adapter);
+	pipe = accept_peer(adapter, mgmtev_cn);
+	adapter_unlock(adapter);
+
+	if (pipe < 0)
+		return pipe;
+
+	engine_wakeup(adapter);
+
+	/* Copy peer address */
+	mac->address.uint64 = mgmtev_cn->src.address.uint64;
+
+	/* Return pipe */
+	return HAL_COMM_ADAPTER(adapter - adapters) | pipe;
+}
+
 int hal_comm_connect(int sockfd, uint64_t *addr)
 {
-	struct nrf24_ll_mgmt_pdu *opdu =
-		(struct nrf24_ll_mgmt_pdu *)mgmt.buffer_tx;
-	struct nrf24_ll_mgmt_connect *payload =
-				(struct nrf24_ll_mgmt_connect *) opdu->payload;
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+	struct nrf24_ll_mgmt_pdu *opdu;
+	struct nrf24_ll_mgmt_connect *payload;
+	struct nrf24_data *peers;
 	size_t len;
+	int slot;
+
+	if (adapter == NULL)
+		return -EPERM;
+
+	peers = adapter->peers;
+	sockfd = HAL_COMM_CHANNEL(sockfd);
+
+	if (sockfd < 1 || sockfd > CONNECTION_COUNTER)
+		return -EINVAL;
 
 	/* Run background procedures */
-	running();
+	adapter_run(adapter);
 
 	/* If already has something to write then returns busy */
-	if (mgmt.len_tx != 0)
+	slot = ring_peek_write(&adapter->mgmt.tx_ring);
+	if (slot < 0)
 		return -EBUSY;
 
+	opdu = (struct nrf24_ll_mgmt_pdu *) adapter->mgmt.tx[slot].data;
+	payload = (struct nrf24_ll_mgmt_connect *) opdu->payload;
+
 	opdu->type = NRF24_PDU_TYPE_CONNECT_REQ;
+	opdu->opts = NRF24_LL_OPT_MSGID |
+			(adapter->config->flags & NRF24_FLAG_ACK_PAYLOAD ?
+					NRF24_LL_OPT_ACK_PAYLOAD : 0);
 
-	payload->src_addr = mac_local;
+	payload->src_addr = adapter->mac_local;
 	payload->dst_addr.address.uint64 = *addr;
-	payload->channel = channel_raw.value;
 	/*
-	 * Set in payload the addr to be set in client.
-	 * sockfd contains the pipe allocated for the client
-	 * aa_pipes contains the Access Address for each pipe
+	 * Set in payload the addr to be set in client: 4 MSB of
+	 * master mac address and the socket index (see alloc_pipe()).
 	 */
+	memcpy(payload->aa, peers[sockfd-1].aa, sizeof(payload->aa));
 
-	/*
-	 * Copy the 5 LSBs of master mac addres
-	 * to access address and the last least
-	 * significant byte is the socket index.
-	 */
+	len = sizeof(struct nrf24_ll_mgmt_connect);
+	len += sizeof(struct nrf24_ll_mgmt_pdu);
+	adapter->mgmt.tx[slot].len = len;
+
+	adapter_lock(adapter);
 
-	memcpy(payload->aa, &mac_local.address.b[3],
-		sizeof(payload->aa));
-	payload->aa[0] = (uint8_t)sockfd;
+#ifndef ARDUINO
+	/* First peer: quietest data channel seen so far */
+	if (!peers_linked(adapter, sockfd))
+		adapter->channel_raw.value = raw_channel(adapter);
+#endif
+	payload->channel = adapter->channel_raw.value;
 
 	/* Source address for keepalive message */
 	peers[sockfd-1].mac.address.uint64 = *addr;
 
-	len = sizeof(struct nrf24_ll_mgmt_connect);
-	len += sizeof(struct nrf24_ll_mgmt_pdu);
-
 	/* Start timeout */
-	peers[sockfd-1].keepalive_anchor = hal_time_ms();
+	keepalive_restart(adapter, &peers[sockfd-1]);
 	/* Enable keep alive: 5 attempts until timeout */
 	peers[sockfd-1].keepalive = 1;
-	mgmt.len_tx = len;
+	/* Until confirmed by the slave */
+	peers[sockfd-1].opts = 0;
+
+	adapter_unlock(adapter);
+
+	ring_commit_write(&adapter->mgmt.tx_ring);
+	engine_wakeup(adapter);
 
 	return 0;
 }
 
+/*
+ * The engine thread owns the IRQ fd and the schedule: the application
+ * only polls the rings.
+ */
+int hal_comm_get_fd(int sockfd)
+{
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+
+	if (adapter == NULL)
+		return -EPERM;
+
+#ifndef ARDUINO
+	if (adapter->wake_fd >= 0)
+		return -ENOSYS;
+#endif
+
+	if (adapter->irq_fd < 0)
+		return -ENOSYS;
+
+	return adapter->irq_fd;
+}
+
+int hal_comm_next_timeout(int sockfd)
+{
+	struct nrf24_adapter *adapter = get_adapter(sockfd);
+
+	if (adapter == NULL)
+		return -1;
+
+#ifndef ARDUINO
+	if (adapter->wake_fd >= 0)
+		return -1;
+#endif
+
+	/* Polling: link layer must run continuously */
+	if (adapter->irq_fd < 0)
+		return 0;
+
+	return running_timeout(adapter);
+}
+
 int nrf24_str2mac(const char *str, struct nrf24_mac *mac)
 {
 	/* Parse the input string into 8 bytes */
@@ -72,3 +72,15 @@ int hal_comm_connect(int sockfd, uint64_t *addr)
 
 	return -ENOSYS;
 }
+
+int hal_comm_get_fd(int sockfd)
+{
+	/* It is not applied to serial ports */
+
+	return -ENOSYS;
+}
+
+int hal_comm_next_timeout(int sockfd)
+{
+	return -1;
+}
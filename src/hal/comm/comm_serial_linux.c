@@ -116,3 +116,14 @@ int hal_comm_connect(int sockfd, uint64_t *addr)
 {
 	return -ENOSYS;
 }
+
+/* Serial port is pollable (POLLIN) */
+int hal_comm_get_fd(int sockfd)
+{
+	return sockfd;
+}
+
+int hal_comm_next_timeout(int sockfd)
+{
+	return -1;
+}
@@ -32,10 +32,19 @@
 
 struct nrf24_ll_mgmt_pdu {
 	uint8_t type:4;
-	uint8_t rfu:4;
+	uint8_t opts:4;			/* CONNECT_REQ: NRF24_LL_OPT_* */
 	uint8_t payload[0];		/* pack beacon of mgmt frames */
 } __attribute__ ((packed));
 
+/*
+ * Link options: offered by the master in the CONNECT_REQ header and
+ * confirmed by the slave in its keepalive responses: unknown bits are
+ * ignored. ACK payloads must be enabled on both sides (nrf24_config
+ * flags), peers running an older link layer support none.
+ */
+#define NRF24_LL_OPT_MSGID		0x01 /* Data PDU msgid and NACKs */
+#define NRF24_LL_OPT_ACK_PAYLOAD	0x02 /* Master data on ACK payloads */
+
 /*
  * Used at ll_mgmt_channel_pdu.payload
  * by slave to announce his presence.
@@ -80,10 +89,17 @@ struct nrf24_ll_mgmt_connect {
 #define NRF24_PDU_LID_DATA_END		0x01 /* Data: End of fragment or complete */
 #define NRF24_PDU_LID_CONTROL		0x03 /* Control */
 
+/*
+ * Fragments of a message share the same msgid and may arrive out of
+ * order: nseq is the fragment index (offset = nseq * NRF24_PW_MSG_SIZE)
+ * and DATA_END is the last one. Retransmissions keep nseq and msgid.
+ * Without NRF24_LL_OPT_MSGID the byte is reserved (zero): fragments
+ * are sent in order, a message starts at nseq 0.
+ */
 struct nrf24_ll_data_pdu {
 	uint8_t lid:2;	/* 00 (data frag), 01 (data complete), 11: (control) */
 	uint8_t nseq:6;	/* Fragment sequence number */
-	uint8_t rfu;  /* Reserved for future use */
+	uint8_t msgid;	/* Message id: incremented for each message */
 	uint8_t payload[0];
 } __attribute__ ((packed));
 
@@ -111,6 +127,7 @@ struct nrf24_ll_crtl_pdu {
 struct nrf24_ll_keepalive {
 	struct nrf24_mac src_addr;	/* Source address */
 	struct nrf24_mac dst_addr;	/* Destination address */
+	uint8_t opts[0];		/* Response: link options accepted */
 } __attribute__ ((packed));
 
 
@@ -127,3 +144,14 @@ struct nrf24_ll_disconnect {
 	struct nrf24_mac src_addr;	/* Source address */
 	struct nrf24_mac dst_addr;	/* Destination address */
 } __attribute__ ((packed));
+
+/*
+ * Receiver to sender: DATA_END of msgid has been received but some
+ * fragments are missing. Only the missing ones are sent again.
+ * Sent only when NRF24_LL_OPT_MSGID has been negotiated.
+ */
+#define NRF24_LL_CRTL_OP_NACK		0x05
+struct nrf24_ll_nack {
+	uint8_t msgid;
+	uint64_t missing;		/* Bit n: fragment nseq n */
+} __attribute__ ((packed));
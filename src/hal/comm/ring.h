@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Single producer/single consumer ring: lock-free index handling for
+ * an array of slots owned by the caller. Slots must be a power of two
+ * (up to 128). The producer fills the slot returned by ring_peek_write()
+ * and publishes it with ring_commit_write(), the consumer uses
+ * ring_peek_read() and ring_commit_read(). Indexes are free running and
+ * only written by their owner side.
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#ifdef ARDUINO
+/* Single execution context: plain accesses */
+#define RING_LOAD(ptr)		(*(ptr))
+#define RING_STORE(ptr, val)	(*(ptr) = (val))
+
+static inline bool ring_cas(uint8_t *ptr, uint8_t expected, uint8_t val)
+{
+	if (*ptr != expected)
+		return false;
+
+	*ptr = val;
+	return true;
+}
+#else
+#define RING_LOAD(ptr)		__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define RING_STORE(ptr, val)	__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+static inline bool ring_cas(uint8_t *ptr, uint8_t expected, uint8_t val)
+{
+	return __atomic_compare_exchange_n(ptr, &expected, val, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+struct ring {
+	uint8_t head;		/* Written by producer */
+	uint8_t tail;		/* Written by consumer (or ring_drop_oldest) */
+	uint8_t mask;		/* Slots - 1 */
+};
+
+static inline void ring_init(struct ring *ring, uint8_t slots)
+{
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = slots - 1;
+}
+
+static inline uint8_t ring_count(const struct ring *ring)
+{
+	return (uint8_t) (RING_LOAD(&ring->head) - RING_LOAD(&ring->tail));
+}
+
+/* Producer: returns the slot to be filled or -1 if full */
+static inline int ring_peek_write(const struct ring *ring)
+{
+	uint8_t tail = RING_LOAD(&ring->tail);
+
+	if ((uint8_t) (ring->head - tail) > ring->mask)
+		return -1;
+
+	return ring->head & ring->mask;
+}
+
+static inline void ring_commit_write(struct ring *ring)
+{
+	RING_STORE(&ring->head, (uint8_t) (ring->head + 1));
+}
+
+/* Consumer: returns the oldest slot or -1 if empty */
+static inline int ring_peek_read(const struct ring *ring)
+{
+	uint8_t head = RING_LOAD(&ring->head);
+
+	if (head == ring->tail)
+		return -1;
+
+	return ring->tail & ring->mask;
+}
+
+static inline void ring_commit_read(struct ring *ring)
+{
+	RING_STORE(&ring->tail, (uint8_t) (ring->tail + 1));
+}
+
+/*
+ * Overwrite mode: when full, the producer may discard the oldest slot
+ * (ring_drop_oldest) before ring_peek_write(). The consumer must then
+ * use ring_peek_read_tail() and ring_commit_read_tail(): false means
+ * the slot has been dropped and reused while it was read.
+ */
+static inline bool ring_drop_oldest(struct ring *ring)
+{
+	uint8_t tail = RING_LOAD(&ring->tail);
+
+	if ((uint8_t) (ring->head - tail) <= ring->mask)
+		return false;
+
+	/* Consumer may have released it meanwhile: not full anymore */
+	return ring_cas(&ring->tail, tail, (uint8_t) (tail + 1));
+}
+
+static inline int ring_peek_read_tail(const struct ring *ring,
+							uint8_t *tail)
+{
+	*tail = RING_LOAD(&ring->tail);
+
+	if (RING_LOAD(&ring->head) == *tail)
+		return -1;
+
+	return *tail & ring->mask;
+}
+
+static inline bool ring_commit_read_tail(struct ring *ring, uint8_t tail)
+{
+	return ring_cas(&ring->tail, tail, (uint8_t) (tail + 1));
+}
+
+#endif /* __RING_H__ */
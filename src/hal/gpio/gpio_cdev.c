@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2017, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * GPIO character device backend (gpiochip uAPI v2): one line request
+ * per pin or per bulk call. Values are set and read by ioctl on the
+ * request fd and edges are read from it with kernel timestamps. Lines
+ * are released when their request fd is closed: no export/unexport.
+ */
+
+#include "hal/gpio_sysfs.h"
+
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+
+#include "gpio_mmap.h"
+#include "gpio_event.h"
+
+#define HIGHEST_GPIO 28
+
+/* Raspberry Pi: line offsets of the first chip are the BCM numbers */
+#ifndef HAL_GPIO_CHIP
+#define HAL_GPIO_CHIP		"/dev/gpiochip0"
+#endif
+
+#define GPIO_CONSUMER		"knot-hal"
+
+struct gpio_line {
+	int fd;			/* Line request: shared by a bulk request */
+	uint8_t bit;		/* Line index in the request */
+	uint8_t mode;
+	uint8_t edge;
+};
+
+static struct gpio_line gpio_line[HIGHEST_GPIO];
+static int chip_fd = -1;
+
+static int gpio_valid(uint8_t gpio)
+{
+	return (gpio > 0 && gpio <= HIGHEST_GPIO);
+}
+
+static uint64_t gpio_flags(const struct gpio_line *line)
+{
+	uint64_t flags;
+
+	if (line->mode == HAL_GPIO_OUTPUT)
+		return GPIO_V2_LINE_FLAG_OUTPUT;
+
+	flags = GPIO_V2_LINE_FLAG_INPUT;
+	if (line->edge & HAL_GPIO_RISING)
+		flags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+	if (line->edge & HAL_GPIO_FALLING)
+		flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+	return flags;
+}
+
+/* Pins sharing the request of the given line */
+static uint8_t gpio_request_lines(int fd)
+{
+	uint8_t i, lines = 0;
+
+	for (i = 0; i < HIGHEST_GPIO; i++) {
+		if (gpio_line[i].fd == fd)
+			lines++;
+	}
+
+	return lines;
+}
+
+/*
+ * Applies the mode/edge of the pins of a request. Outputs keep their
+ * current value: a new configuration would drive them low otherwise.
+ */
+static int gpio_request_config(int fd)
+{
+	struct gpio_v2_line_config config;
+	struct gpio_v2_line_values values;
+	struct gpio_v2_line_config_attribute *attr;
+	uint64_t flags, outputs = 0;
+	uint8_t i, j;
+
+	memset(&config, 0, sizeof(config));
+
+	for (i = 0; i < HIGHEST_GPIO; i++) {
+		if (gpio_line[i].fd != fd)
+			continue;
+
+		flags = gpio_flags(&gpio_line[i]);
+		if (gpio_line[i].mode == HAL_GPIO_OUTPUT)
+			outputs |= (uint64_t) 1 << gpio_line[i].bit;
+
+		/* Lines with the same flags share one attribute */
+		for (j = 0; j < config.num_attrs; j++) {
+			if (config.attrs[j].attr.flags == flags)
+				break;
+		}
+
+		if (j == config.num_attrs) {
+			if (j == GPIO_V2_LINE_NUM_ATTRS_MAX - 1)
+				return -E2BIG;
+
+			config.attrs[j].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+			config.attrs[j].attr.flags = flags;
+			config.num_attrs++;
+		}
+
+		config.attrs[j].mask |= (uint64_t) 1 << gpio_line[i].bit;
+	}
+
+	if (outputs) {
+		values.mask = outputs;
+		if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+			values.bits = 0;
+
+		attr = &config.attrs[config.num_attrs++];
+		attr->attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		attr->attr.values = values.bits;
+		attr->mask = outputs;
+	}
+
+	if (ioctl(fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int gpio_request(const uint8_t *gpio, uint8_t count, uint8_t mode)
+{
+	struct gpio_v2_line_request req;
+	struct gpio_line *line;
+	uint8_t i;
+
+	memset(&req, 0, sizeof(req));
+	strncpy(req.consumer, GPIO_CONSUMER, sizeof(req.consumer) - 1);
+	req.config.flags = (mode == HAL_GPIO_OUTPUT ?
+			GPIO_V2_LINE_FLAG_OUTPUT : GPIO_V2_LINE_FLAG_INPUT);
+	req.num_lines = count;
+
+	for (i = 0; i < count; i++)
+		req.offsets[i] = gpio[i];
+
+	if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+		return -errno;
+
+	for (i = 0; i < count; i++) {
+		line = &gpio_line[gpio[i] - 1];
+		line->fd = req.fd;
+		line->bit = i;
+		line->mode = mode;
+		line->edge = HAL_GPIO_NONE;
+	}
+
+	return 0;
+}
+
+/* Lines are released when the last pin of their request is released */
+static void gpio_release(uint8_t gpio)
+{
+	struct gpio_line *line = &gpio_line[gpio - 1];
+
+	if (line->fd < 0)
+		return;
+
+	if (gpio_request_lines(line->fd) == 1)
+		close(line->fd);
+
+	line->fd = -1;
+}
+
+static int gpio_write(uint8_t gpio, uint8_t value)
+{
+	struct gpio_line *line = &gpio_line[gpio - 1];
+	struct gpio_v2_line_values values;
+
+	values.mask = (uint64_t) 1 << line->bit;
+	values.bits = (value == HAL_GPIO_LOW ? 0 : values.mask);
+
+	if (ioctl(line->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int gpio_read(uint8_t gpio)
+{
+	struct gpio_line *line = &gpio_line[gpio - 1];
+	struct gpio_v2_line_values values;
+
+	values.mask = (uint64_t) 1 << line->bit;
+
+	if (ioctl(line->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+		return -errno;
+
+	return (values.bits & values.mask ? HAL_GPIO_HIGH : HAL_GPIO_LOW);
+}
+
+int hal_gpio_setup(void)
+{
+	int i;
+
+	/* Shared by the radio modules: lines requested are kept */
+	if (chip_fd >= 0)
+		return 0;
+
+	chip_fd = open(HAL_GPIO_CHIP, O_RDWR | O_CLOEXEC);
+	if (chip_fd < 0)
+		return -errno;
+
+	for (i = 0; i < HIGHEST_GPIO; i++) {
+		gpio_line[i].fd = -1;
+		gpio_line[i].bit = 0;
+		gpio_line[i].mode = HAL_GPIO_INPUT;
+		gpio_line[i].edge = HAL_GPIO_NONE;
+	}
+
+	return 0;
+}
+
+void hal_gpio_unmap(void)
+{
+	int i;
+
+	gpio_event_release();
+	gpio_mmap_release();
+
+	if (chip_fd < 0)
+		return;
+
+	for (i = 0; i < HIGHEST_GPIO; i++)
+		gpio_release(i + 1);
+
+	close(chip_fd);
+	chip_fd = -1;
+}
+
+int hal_gpio_pin_mode(uint8_t gpio, uint8_t mode)
+{
+	struct gpio_line *line;
+	int err;
+
+	if (!gpio_valid(gpio))
+		/* Cannot initialize gpio: maximum gpio exceeded */
+		return -EINVAL;
+
+	err = hal_gpio_setup();
+	if (err < 0)
+		return err;
+
+	line = &gpio_line[gpio - 1];
+	if (line->fd < 0)
+		return gpio_request(&gpio, 1, mode);
+
+	if (line->mode == mode)
+		return 0;
+
+	line->mode = mode;
+	line->edge = HAL_GPIO_NONE;
+
+	return gpio_request_config(line->fd);
+}
+
+int hal_gpio_pin_mode_bulk(const uint8_t *gpio, uint8_t count, uint8_t mode)
+{
+	int err;
+	uint8_t i;
+
+	if (count == 0 || count > GPIO_V2_LINES_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!gpio_valid(gpio[i]))
+			return -EINVAL;
+	}
+
+	err = hal_gpio_setup();
+	if (err < 0)
+		return err;
+
+	/* Pins of another bulk request can't be moved */
+	for (i = 0; i < count; i++) {
+		if (gpio_line[gpio[i] - 1].fd >= 0 &&
+			gpio_request_lines(gpio_line[gpio[i] - 1].fd) > 1)
+			return -EBUSY;
+	}
+
+	for (i = 0; i < count; i++)
+		gpio_release(gpio[i]);
+
+	return gpio_request(gpio, count, mode);
+}
+
+void hal_gpio_digital_write(uint8_t gpio, uint8_t value)
+{
+	if (!gpio_valid(gpio))
+		return;
+
+	if (hal_gpio_pin_mode(gpio, HAL_GPIO_OUTPUT) < 0)
+		return;
+
+	if (!gpio_mmap_write(gpio, value))
+		gpio_write(gpio, value);
+}
+
+int hal_gpio_digital_read(uint8_t gpio)
+{
+	int err;
+
+	if (!gpio_valid(gpio))
+		return -EINVAL;
+
+	err = hal_gpio_pin_mode(gpio, HAL_GPIO_INPUT);
+	if (err < 0)
+		return err;
+
+	return gpio_read(gpio);
+}
+
+/* Pins sharing a request are set or read by one ioctl */
+int hal_gpio_digital_write_bulk(const uint8_t *gpio, const uint8_t *value,
+								uint8_t count)
+{
+	struct gpio_v2_line_values values;
+	struct gpio_line *line;
+	uint64_t done = 0;
+	uint8_t i, j;
+	int err;
+
+	if (count > GPIO_V2_LINES_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!gpio_valid(gpio[i]))
+			return -EINVAL;
+
+		err = hal_gpio_pin_mode(gpio[i], HAL_GPIO_OUTPUT);
+		if (err < 0)
+			return err;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (done & ((uint64_t) 1 << i))
+			continue;
+
+		line = &gpio_line[gpio[i] - 1];
+		values.mask = 0;
+		values.bits = 0;
+
+		for (j = i; j < count; j++) {
+			if (gpio_line[gpio[j] - 1].fd != line->fd)
+				continue;
+
+			values.mask |= (uint64_t) 1 << gpio_line[gpio[j] - 1].bit;
+			if (value[j] != HAL_GPIO_LOW)
+				values.bits |= (uint64_t) 1 <<
+						gpio_line[gpio[j] - 1].bit;
+			done |= (uint64_t) 1 << j;
+		}
+
+		if (ioctl(line->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+int hal_gpio_digital_read_bulk(const uint8_t *gpio, uint8_t *value,
+								uint8_t count)
+{
+	struct gpio_v2_line_values values;
+	struct gpio_line *line;
+	uint64_t done = 0, mask;
+	uint8_t i, j;
+	int err;
+
+	if (count > GPIO_V2_LINES_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!gpio_valid(gpio[i]))
+			return -EINVAL;
+
+		err = hal_gpio_pin_mode(gpio[i], HAL_GPIO_INPUT);
+		if (err < 0)
+			return err;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (done & ((uint64_t) 1 << i))
+			continue;
+
+		line = &gpio_line[gpio[i] - 1];
+		values.mask = 0;
+
+		for (j = i; j < count; j++) {
+			if (gpio_line[gpio[j] - 1].fd == line->fd)
+				values.mask |= (uint64_t) 1 <<
+						gpio_line[gpio[j] - 1].bit;
+		}
+
+		if (ioctl(line->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+			return -errno;
+
+		for (j = i; j < count; j++) {
+			if (gpio_line[gpio[j] - 1].fd != line->fd)
+				continue;
+
+			mask = (uint64_t) 1 << gpio_line[gpio[j] - 1].bit;
+			value[j] = (values.bits & mask ? HAL_GPIO_HIGH :
+								HAL_GPIO_LOW);
+			done |= (uint64_t) 1 << j;
+		}
+	}
+
+	return 0;
+}
+
+int hal_gpio_analog_read(uint8_t gpio)
+{
+	return 0;
+}
+
+void hal_gpio_analog_reference(uint8_t mode)
+{
+
+}
+
+void hal_gpio_analog_write(uint8_t gpio, int value)
+{
+
+}
+
+/*
+ * Returns a duplicate of the line request fd: closing it doesn't
+ * release the line. Edges are signaled as POLLIN, see
+ * hal_gpio_poll_events(), and must be consumed by
+ * hal_gpio_read_events(). Pins sharing a request share their edges.
+ */
+int hal_gpio_get_fd(uint8_t gpio, int edge)
+{
+	struct gpio_line *line;
+	int err, fd;
+
+	if (!gpio_valid(gpio))
+		return -EINVAL;
+
+	line = &gpio_line[gpio - 1];
+	if (chip_fd < 0 || line->fd < 0 || line->mode != HAL_GPIO_INPUT)
+		return -EIO;
+
+	line->edge = edge;
+	err = gpio_request_config(line->fd);
+	if (err < 0)
+		return err;
+
+	fd = fcntl(line->fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	/* File status flags are shared: reading never blocks */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+short hal_gpio_poll_events(void)
+{
+	return POLLIN | POLLERR;
+}
+
+int hal_gpio_read_events(int fd, struct hal_gpio_event *events, int count)
+{
+	struct gpio_v2_line_event buf[8];
+	ssize_t len;
+	int i, n;
+
+	if (count <= 0)
+		return 0;
+
+	if (count > (int) (sizeof(buf) / sizeof(buf[0])))
+		count = sizeof(buf) / sizeof(buf[0]);
+
+	len = read(fd, buf, count * sizeof(buf[0]));
+	if (len < 0)
+		return (errno == EAGAIN ? 0 : -errno);
+
+	n = len / sizeof(buf[0]);
+	for (i = 0; i < n; i++) {
+		events[i].gpio = buf[i].offset;
+		events[i].edge = (buf[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE ?
+					HAL_GPIO_RISING : HAL_GPIO_FALLING);
+		events[i].timestamp_ns = buf[i].timestamp_ns;
+	}
+
+	return n;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Edge event multiplexer: the fd of each watched pin (hal_gpio_get_fd)
+ * is added to one epoll instance. Its fd becomes readable when any pin
+ * has pending edges, hal_gpio_event_dispatch() reads them and calls the
+ * callback of each pin with its batch. Built on the backend calls only.
+ */
+
+#include "hal/gpio_sysfs.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "gpio_event.h"
+
+#define HIGHEST_GPIO 28
+
+/* Edges read at once from a pin: a callback may get several batches */
+#define EVENT_BATCH		16
+#define EPOLL_EVENTS		8
+
+struct gpio_watch {
+	int fd;				/* hal_gpio_get_fd() */
+	hal_gpio_event_func func;	/* NULL: not watched */
+	void *user_data;
+};
+
+static struct gpio_watch gpio_watch[HIGHEST_GPIO];
+
+/* Kept until hal_gpio_unmap(): the main loop may hold it meanwhile */
+static int epoll_fd = -1;
+
+static void watch_release(uint8_t gpio)
+{
+	struct gpio_watch *watch = &gpio_watch[gpio - 1];
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+	close(watch->fd);
+
+	watch->fd = -1;
+	watch->func = NULL;
+	watch->user_data = NULL;
+}
+
+/*
+ * The pin must be an input (hal_gpio_pin_mode). Watching it again
+ * replaces its edge and callback.
+ */
+int hal_gpio_event_add(uint8_t gpio, int edge, hal_gpio_event_func func,
+							void *user_data)
+{
+	struct gpio_watch *watch;
+	struct epoll_event ev;
+	int fd, err;
+
+	if (gpio == 0 || gpio > HIGHEST_GPIO || func == NULL)
+		return -EINVAL;
+
+	watch = &gpio_watch[gpio - 1];
+	if (watch->func)
+		watch_release(gpio);
+
+	if (epoll_fd < 0) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			return -errno;
+	}
+
+	fd = hal_gpio_get_fd(gpio, edge);
+	if (fd < 0)
+		return fd;
+
+	/* poll() and epoll event bits have the same values */
+	ev.events = hal_gpio_poll_events();
+	ev.data.u32 = gpio;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	watch->fd = fd;
+	watch->func = func;
+	watch->user_data = user_data;
+
+	return 0;
+}
+
+int hal_gpio_event_remove(uint8_t gpio)
+{
+	if (gpio == 0 || gpio > HIGHEST_GPIO ||
+				gpio_watch[gpio - 1].func == NULL)
+		return -ENOENT;
+
+	watch_release(gpio);
+
+	return 0;
+}
+
+int hal_gpio_event_get_fd(void)
+{
+	return (epoll_fd < 0 ? -ENOENT : epoll_fd);
+}
+
+/* Consecutive edges of the same pin are delivered as one batch */
+static void event_deliver(const struct hal_gpio_event *events, int count)
+{
+	struct gpio_watch *watch;
+	int i, start = 0;
+
+	for (i = 1; i <= count; i++) {
+		if (i < count && events[i].gpio == events[start].gpio)
+			continue;
+
+		watch = &gpio_watch[events[start].gpio - 1];
+
+		/* Removed by a previous callback */
+		if (watch->func)
+			watch->func(&events[start], i - start,
+							watch->user_data);
+		start = i;
+	}
+}
+
+/*
+ * Never blocks: returns the number of edges read or a negative error.
+ * Callbacks may add or remove pins, including their own.
+ */
+int hal_gpio_event_dispatch(void)
+{
+	struct epoll_event ev[EPOLL_EVENTS];
+	struct hal_gpio_event events[EVENT_BATCH];
+	struct gpio_watch *watch;
+	int i, j, n, ret, count = 0;
+	uint8_t gpio;
+
+	if (epoll_fd < 0)
+		return 0;
+
+	n = epoll_wait(epoll_fd, ev, EPOLL_EVENTS, 0);
+	if (n < 0)
+		return (errno == EINTR ? 0 : -errno);
+
+	for (i = 0; i < n; i++) {
+		gpio = ev[i].data.u32;
+		watch = &gpio_watch[gpio - 1];
+
+		do {
+			if (watch->func == NULL)
+				break;
+
+			ret = hal_gpio_read_events(watch->fd, events,
+								EVENT_BATCH);
+			if (ret <= 0)
+				break;
+
+			/*
+			 * cdev: pins of a bulk request share their edges,
+			 * sysfs: the pin may be unknown.
+			 */
+			for (j = 0; j < ret; j++) {
+				if (events[j].gpio == 0 ||
+					events[j].gpio > HIGHEST_GPIO)
+					events[j].gpio = gpio;
+			}
+
+			event_deliver(events, ret);
+			count += ret;
+		} while (ret == EVENT_BATCH);
+	}
+
+	return count;
+}
+
+void gpio_event_release(void)
+{
+	uint8_t gpio;
+
+	for (gpio = 1; gpio <= HIGHEST_GPIO; gpio++) {
+		if (gpio_watch[gpio - 1].func)
+			watch_release(gpio);
+	}
+
+	if (epoll_fd < 0)
+		return;
+
+	close(epoll_fd);
+	epoll_fd = -1;
+}
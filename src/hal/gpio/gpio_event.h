@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) 2017, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#ifndef __GPIO_EVENT_H__
+#define __GPIO_EVENT_H__
+
+/* Backends: pins are released by hal_gpio_unmap() */
+void gpio_event_release(void);
+
+#endif /* __GPIO_EVENT_H__ */
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include "hal/gpio_sysfs.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "gpio_mmap.h"
+
+/* /dev/gpiomem: GPIO block only, no root required (unlike /dev/mem) */
+#define GPIO_MMAP_PATH		"/dev/gpiomem"
+#define GPIO_MMAP_SIZE		4096
+
+/* Up to GPLEV1: last register of the block accessed */
+#define GPIO_MMAP_MIN_SIZE	0x3c
+
+/* Word offsets: output set and clear registers, pins 0 to 31 */
+#define GPIO_REG_SET0		(0x1c / 4)
+#define GPIO_REG_CLR0		(0x28 / 4)
+
+static volatile uint32_t *gpio_regs = NULL;
+
+/*
+ * Opt-in: hal_gpio_digital_write() of output pins becomes a store into
+ * the mapped set/clear registers. Any other path (a regular file of at
+ * least GPIO_MMAP_MIN_SIZE bytes) allows checking the stores. On error
+ * the mapping is left as it was and writes keep using the backend.
+ */
+int hal_gpio_mmap(const char *path)
+{
+	struct stat st;
+	void *regs;
+	int fd, err;
+
+	if (path == NULL)
+		path = GPIO_MMAP_PATH;
+
+	fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	if (S_ISREG(st.st_mode) && st.st_size < GPIO_MMAP_MIN_SIZE) {
+		err = -EINVAL;
+		goto done;
+	}
+
+	regs = mmap(NULL, GPIO_MMAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+									fd, 0);
+	if (regs == MAP_FAILED) {
+		err = -errno;
+		goto done;
+	}
+
+	gpio_mmap_release();
+	gpio_regs = regs;
+	err = 0;
+
+done:
+	/* The mapping remains valid after closing */
+	close(fd);
+
+	return err;
+}
+
+bool gpio_mmap_write(uint8_t gpio, uint8_t value)
+{
+	volatile uint32_t *regs = gpio_regs;
+
+	if (regs == NULL || gpio > 31)
+		return false;
+
+	regs[value == HAL_GPIO_LOW ? GPIO_REG_CLR0 : GPIO_REG_SET0] =
+							(uint32_t) 1 << gpio;
+
+	return true;
+}
+
+void gpio_mmap_release(void)
+{
+	if (gpio_regs == NULL)
+		return;
+
+	munmap((void *) gpio_regs, GPIO_MMAP_SIZE);
+	gpio_regs = NULL;
+}
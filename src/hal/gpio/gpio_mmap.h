@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2017, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * BCM283x GPIO registers mapped by hal_gpio_mmap(): output pins are
+ * set or cleared by a single store, without system call. Used by the
+ * Linux backends once the pin has been configured as output.
+ */
+
+#ifndef __GPIO_MMAP_H__
+#define __GPIO_MMAP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* False if not mapped (or not a bank 0 pin): the backend writes it */
+bool gpio_mmap_write(uint8_t gpio, uint8_t value);
+void gpio_mmap_release(void);
+
+#endif /* __GPIO_MMAP_H__ */
@@ -18,6 +18,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#include "gpio_mmap.h"
+#include "gpio_event.h"
 
 #define HIGHEST_GPIO 28
 
@@ -245,6 +250,7 @@ int hal_gpio_setup(void)
 		gpio_pin[i].status = 0;
 		gpio_pin[i].fd_value = -1;
 		gpio_pin[i].fd_unexport = -1;
+		gpio_pin[i].fd_edge = -1;
 	}
 
 	return 0;
@@ -254,6 +260,9 @@ void hal_gpio_unmap(void)
 {
 	int i;
 
+	gpio_event_release();
+	gpio_mmap_release();
+
 	for (i = 0; i < HIGHEST_GPIO; ++i)
 		if (CHK_BIT(gpio_pin[i].status, BIT_INITIALIZED))
 			gpio_unexport(i+1);
@@ -293,9 +302,10 @@ int hal_gpio_pin_mode(uint8_t gpio, uint8_t mode)
 void hal_gpio_digital_write(uint8_t gpio, uint8_t value)
 {
 	if (CHK_BIT(gpio_pin[gpio-1].status, BIT_DIRECTION)
-		&& CHK_BIT(gpio_pin[gpio-1].status, BIT_INITIALIZED))
-		gpio_write(gpio, value);
-	else{
+		&& CHK_BIT(gpio_pin[gpio-1].status, BIT_INITIALIZED)) {
+		if (!gpio_mmap_write(gpio, value))
+			gpio_write(gpio, value);
+	} else {
 		/* Changing mode and writing */
 		hal_gpio_pin_mode(gpio, HAL_GPIO_OUTPUT);
 		hal_gpio_digital_write(gpio, value);
@@ -346,11 +356,12 @@ void hal_gpio_analog_write(uint8_t gpio, int value)
  * to read the value.".
  *
  * In case you are using GLIB you must set the conditions
- * G_IO_PRI and G_IO_ERR.
+ * G_IO_PRI and G_IO_ERR. hal_gpio_poll_events() and
+ * hal_gpio_read_events() follow these rules on any backend.
  */
 int hal_gpio_get_fd(uint8_t gpio, int edge)
 {
-	int err;
+	int err, fd, i;
 
 	if (!CHK_BIT(gpio_pin[gpio-1].status, BIT_INITIALIZED) ||
 		CHK_BIT(gpio_pin[gpio-1].status, BIT_DIRECTION))
@@ -360,5 +371,107 @@ int hal_gpio_get_fd(uint8_t gpio, int edge)
 	if (err < 0)
 		return err;
 
-	return get_gpio_fd(gpio);
+	fd = get_gpio_fd(gpio);
+	if (fd < 0)
+		return fd;
+
+	/* Descriptor closed by the caller: its number may be reused */
+	for (i = 0; i < HIGHEST_GPIO; i++) {
+		if (gpio_pin[i].fd_edge == fd)
+			gpio_pin[i].fd_edge = -1;
+	}
+
+	gpio_pin[gpio-1].fd_edge = fd;
+
+	return fd;
+}
+
+int hal_gpio_pin_mode_bulk(const uint8_t *gpio, uint8_t count, uint8_t mode)
+{
+	int err;
+	uint8_t i;
+
+	for (i = 0; i < count; i++) {
+		err = hal_gpio_pin_mode(gpio[i], mode);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+int hal_gpio_digital_write_bulk(const uint8_t *gpio, const uint8_t *value,
+								uint8_t count)
+{
+	uint8_t i;
+
+	for (i = 0; i < count; i++)
+		hal_gpio_digital_write(gpio[i], value[i]);
+
+	return 0;
+}
+
+int hal_gpio_digital_read_bulk(const uint8_t *gpio, uint8_t *value,
+								uint8_t count)
+{
+	int ret;
+	uint8_t i;
+
+	for (i = 0; i < count; i++) {
+		ret = hal_gpio_digital_read(gpio[i]);
+		if (ret < 0)
+			return ret;
+
+		value[i] = ret;
+	}
+
+	return 0;
+}
+
+short hal_gpio_poll_events(void)
+{
+	return POLLPRI | POLLERR;
+}
+
+/*
+ * sysfs only tells that the value has changed: the edge is deduced
+ * from the value read and the timestamp is taken when reading it.
+ */
+int hal_gpio_read_events(int fd, struct hal_gpio_event *events, int count)
+{
+	struct pollfd pfd;
+	struct timespec spec;
+	char value[2] = "0";
+	int i;
+
+	if (count <= 0)
+		return 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLPRI | POLLERR;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, 0) < 0)
+		return -errno;
+
+	if (!(pfd.revents & POLLPRI))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+
+	if (lseek(fd, 0, SEEK_SET) < 0 ||
+				read(fd, value, sizeof(value)) < 0)
+		return -errno;
+
+	events->gpio = 0;
+	for (i = 0; i < HIGHEST_GPIO; i++) {
+		if (gpio_pin[i].fd_edge == fd)
+			events->gpio = i + 1;
+	}
+
+	events->edge = (value[0] == '1' ? HAL_GPIO_RISING : HAL_GPIO_FALLING);
+	events->timestamp_ns = (uint64_t) spec.tv_sec * 1000000000 +
+								spec.tv_nsec;
+
+	return 1;
 }
@@ -13,9 +13,50 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "hal/linux_log.h"
 
+/*
+ * Asynchronous records: bounded multi-producer ring. Each slot has a
+ * sequence number telling whose turn it is: a producer reserves a slot
+ * by moving the head (CAS) and publishes it by setting the sequence,
+ * the log thread (single consumer) releases it for the next lap.
+ */
+#define LOG_RING_SIZE		256	/* Power of two */
+#define LOG_RING_MASK		(LOG_RING_SIZE - 1)
+#define LOG_FLUSH_MS		20	/* Log thread: ring polling period */
+#define LOG_LINE_SIZE		256
+
+struct log_record {
+	uint64_t timestamp;			/* CLOCK_MONOTONIC: us */
+	hal_log_format_func format;
+	uint64_t args[HAL_LOG_ARGS];
+	uint8_t level;
+	uint8_t len;
+	uint8_t payload[HAL_LOG_PAYLOAD];
+};
+
+struct log_slot {
+	uint32_t seq;
+	struct log_record record;
+};
+
+static struct log_slot log_ring[LOG_RING_SIZE];
+static uint32_t log_head;		/* Next slot to be reserved */
+static uint32_t log_tail;		/* Log thread only */
+static uint32_t log_dropped;
+static uint8_t log_async;		/* Producers: ring enabled */
+static uint32_t log_writers;		/* Producers inside hal_log_record() */
+static uint8_t log_stop;
+static pthread_t log_thread;
+
 void hal_log_error(const char *format, ...)
 {
 	va_list ap;
@@ -52,6 +93,193 @@ void hal_log_dbg(const char *format, ...)
 	va_end(ap);
 }
 
+static uint64_t log_time_us(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+
+	return (uint64_t) spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
+/* Deferred records are prefixed by their time: syslog's is the flush's */
+static void log_emit(const struct log_record *record, bool deferred)
+{
+	char line[LOG_LINE_SIZE];
+
+	record->format(line, sizeof(line), record->args, record->payload,
+								record->len);
+	line[sizeof(line) - 1] = '\0';
+
+	if (!deferred) {
+		syslog(record->level, "%s", line);
+		return;
+	}
+
+	syslog(record->level, "%" PRIu64 ".%06" PRIu64 " %s",
+				record->timestamp / 1000000,
+				record->timestamp % 1000000, line);
+}
+
+static bool log_ring_push(const struct log_record *record)
+{
+	struct log_slot *slot;
+	uint32_t pos, seq;
+	int32_t diff;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &log_ring[pos & LOG_RING_MASK];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int32_t) (seq - pos);
+
+		/* Full: the log thread hasn't released it yet */
+		if (diff < 0)
+			return false;
+
+		/* Free: reserve it, pos is reloaded on failure */
+		if (diff == 0 && __atomic_compare_exchange_n(&log_head, &pos,
+				pos + 1, true, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+			break;
+
+		/* Reserved by another producer meanwhile */
+		if (diff > 0)
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	}
+
+	slot->record = *record;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static bool log_ring_pop(struct log_record *record)
+{
+	struct log_slot *slot = &log_ring[log_tail & LOG_RING_MASK];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+		return false;
+
+	*record = slot->record;
+	__atomic_store_n(&slot->seq, log_tail + LOG_RING_SIZE,
+							__ATOMIC_RELEASE);
+	log_tail++;
+
+	return true;
+}
+
+static void log_flush(void)
+{
+	struct log_record record;
+	uint32_t dropped;
+
+	while (log_ring_pop(&record))
+		log_emit(&record, true);
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		syslog(LOG_WARNING, "log: %u records dropped", dropped);
+}
+
+static void *log_thread_func(void *user_data)
+{
+	struct timespec period = {
+		.tv_sec = 0,
+		.tv_nsec = LOG_FLUSH_MS * 1000000,
+	};
+
+	/* Producers never wake the thread: no system call on their side */
+	while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+		log_flush();
+		nanosleep(&period, NULL);
+	}
+
+	log_flush();
+
+	return NULL;
+}
+
+void hal_log_record(int level, hal_log_format_func format,
+			const uint64_t *args, uint8_t nargs,
+			const void *payload, size_t len)
+{
+	struct log_record record;
+
+	if (nargs > HAL_LOG_ARGS)
+		nargs = HAL_LOG_ARGS;
+
+	if (len > HAL_LOG_PAYLOAD)
+		len = HAL_LOG_PAYLOAD;
+
+	record.format = format;
+	record.level = level;
+	record.len = len;
+	memset(record.args, 0, sizeof(record.args));
+	if (nargs)
+		memcpy(record.args, args, nargs * sizeof(args[0]));
+	if (len)
+		memcpy(record.payload, payload, len);
+
+	/*
+	 * Announced before testing log_async: hal_log_async_stop() waits
+	 * for the producers that may still push once it has been cleared.
+	 */
+	__atomic_fetch_add(&log_writers, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&log_async, __ATOMIC_SEQ_CST)) {
+		__atomic_fetch_sub(&log_writers, 1, __ATOMIC_RELEASE);
+		log_emit(&record, false);
+		return;
+	}
+
+	record.timestamp = log_time_us();
+	if (!log_ring_push(&record))
+		__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+
+	__atomic_fetch_sub(&log_writers, 1, __ATOMIC_RELEASE);
+}
+
+int hal_log_async_start(void)
+{
+	uint32_t i;
+	int err;
+
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		return -EALREADY;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+
+	log_head = 0;
+	log_tail = 0;
+	log_dropped = 0;
+	log_stop = 0;
+
+	err = pthread_create(&log_thread, NULL, log_thread_func, NULL);
+	if (err)
+		return -err;
+
+	__atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Records already queued are written before returning */
+void hal_log_async_stop(void)
+{
+	if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&log_async, 0, __ATOMIC_SEQ_CST);
+
+	/* Pushes still in progress: the thread's last flush must see them */
+	while (__atomic_load_n(&log_writers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	__atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(log_thread, NULL);
+}
+
 void hal_log_init(const char *ident, int detach)
 {
 	int option = LOG_NDELAY | LOG_PID | LOG_PERROR;
@@ -61,5 +289,6 @@ void hal_log_init(const char *ident, int detach)
 
 void hal_log_close(void)
 {
+	hal_log_async_stop();
 	closelog();
 }
@@ -8,7 +8,6 @@
  */
 
 #include <Arduino.h>
-#include <limits.h>
 #include <stdlib.h>
 
 #include "hal/time.h"
@@ -23,6 +22,31 @@ uint32_t hal_time_us(void)
 	return micros();
 }
 
+/* Wraps are counted: must be called at least once per wrap period */
+uint64_t hal_time64_ms(void)
+{
+	static uint32_t last, high;
+	uint32_t now = millis();
+
+	if (now < last)
+		high++;
+	last = now;
+
+	return ((uint64_t) high << 32) | now;
+}
+
+uint64_t hal_time64_us(void)
+{
+	static uint32_t last, high;
+	uint32_t now = micros();
+
+	if (now < last)
+		high++;
+	last = now;
+
+	return ((uint64_t) high << 32) | now;
+}
+
 void hal_delay_ms(uint32_t ms)
 {
 	delay(ms);
@@ -35,16 +59,8 @@ void hal_delay_us(uint32_t us)
 
 int hal_timeout(uint32_t current,  uint32_t start,  uint32_t timeout)
 {
-	/* Time overflow */
-	if (current < start)
-		/* Fit time overflow and compute time elapsed */
-		current += (ULONG_MAX - start);
-	else
-		/* Compute time elapsed */
-		current -= start;
-
-	/* Timeout is flagged */
-	return (current >= timeout);
+	/* Time elapsed: modulo 2^32, overflow included */
+	return ((uint32_t) (current - start) >= timeout);
 }
 
 int hal_getrandom(void *buf, size_t buflen)
@@ -8,71 +8,115 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <time.h>
-#include <limits.h>
 
 #include <linux/random.h>
 #include <sys/syscall.h>
 #include "hal/time.h"
 
-#define MS 1
-#define US 0
-
-static uint32_t get_time(uint8_t unit)
+/* CLOCK_MONOTONIC: NTP and wall clock steps don't move timeouts */
+static uint64_t get_time_us(void)
 {
 	struct timespec spec;
-	uint32_t t;
-	long mult, div;
 
-	clock_gettime(CLOCK_REALTIME, &spec);
+	clock_gettime(CLOCK_MONOTONIC, &spec);
 
-	if (unit) {
-		mult = 1000;
-		div = 1.0e6;
-	} else {
-		mult = 1.0e6;
-		div = 1.0e3;
-	}
+	return (uint64_t) spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
 
-	t = (uint32_t)(spec.tv_sec * mult);
-	t += (uint32_t)(spec.tv_nsec / div);
+uint64_t hal_time64_ms(void)
+{
+	return get_time_us() / 1000;
+}
 
-	return t;
+uint64_t hal_time64_us(void)
+{
+	return get_time_us();
 }
 
 uint32_t hal_time_ms(void)
 {
-	return get_time(MS);
+	return (uint32_t) hal_time64_ms();
 }
 
 uint32_t hal_time_us(void)
 {
-	return get_time(US);
+	return (uint32_t) get_time_us();
+}
+
+/*
+ * usleep() overshoots by the timer slack plus the wakeup latency: at
+ * least 50 us, often more than 100 us. Short delays (nRF24 CE pulse and
+ * settling times) busy wait on the monotonic clock. Longer ones sleep up
+ * to DELAY_SLACK_US before the deadline and busy wait the remainder.
+ */
+#define DELAY_SPIN_US		200
+#define DELAY_SLACK_US		100
+
+static void timespec_add_us(struct timespec *spec, uint64_t us)
+{
+	spec->tv_sec += us / 1000000;
+	spec->tv_nsec += (us % 1000000) * 1000;
+	if (spec->tv_nsec >= 1000000000) {
+		spec->tv_sec++;
+		spec->tv_nsec -= 1000000000;
+	}
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return (a->tv_sec < b->tv_sec ? -1 : 1);
+
+	if (a->tv_nsec != b->tv_nsec)
+		return (a->tv_nsec < b->tv_nsec ? -1 : 1);
+
+	return 0;
+}
+
+static void delay_wait(uint64_t us)
+{
+	struct timespec start, deadline, now;
+
+	if (us == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (us > DELAY_SPIN_US) {
+		deadline = start;
+		timespec_add_us(&deadline, us - DELAY_SLACK_US);
+
+		/* Absolute: signals don't stretch the delay */
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&deadline, NULL) == EINTR)
+			;
+	}
+
+	deadline = start;
+	timespec_add_us(&deadline, us);
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (timespec_cmp(&now, &deadline) < 0);
 }
 
 void hal_delay_ms(uint32_t ms)
 {
-	usleep(ms * 1000);
+	delay_wait((uint64_t) ms * 1000);
 }
 
 void hal_delay_us(uint32_t us)
 {
-	usleep(us);
+	delay_wait(us);
 }
 
 int hal_timeout(uint32_t current,  uint32_t start,  uint32_t timeout)
 {
-	/* Time overflow */
-	if (current < start)
-		/* Fit time overflow and compute time elapsed */
-		current += (ULONG_MAX - start);
-	else
-		/* Compute time elapsed */
-		current -= start;
-
-	/* Timeout is flagged */
-	return (current >= timeout);
+	/* Time elapsed: modulo 2^32, overflow included */
+	return ((uint32_t) (current - start) >= timeout);
 }
 
 int hal_getrandom(void *buf, size_t buflen)
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "hal/time.h"
+
+/*
+ * Level L holds the timers expiring within SLOTS^(L+1) ms from the next
+ * tick, in the slot of their expiration tick bits [L x BITS, (L+1) x
+ * BITS). When the lower bits of the tick wrap, the slot of the level
+ * above is moved down (cascade): only level 0 timers are called.
+ */
+#define SLOT_MASK		(HAL_TIMER_SLOTS - 1)
+#define LEVEL_SHIFT(level)	((level) * HAL_TIMER_SLOT_BITS)
+#define LEVEL_SPAN(level)	((uint64_t) 1 << LEVEL_SHIFT((level) + 1))
+#define SLOT_INDEX(tick, level)	(((tick) >> LEVEL_SHIFT(level)) & SLOT_MASK)
+
+/* Detached: being called by hal_timer_run() */
+#define LEVEL_NONE		HAL_TIMER_LEVELS
+
+static void timer_link(struct hal_timer **head, struct hal_timer *timer)
+{
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void timer_unlink(struct hal_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static void timer_insert(struct hal_timer_wheel *wheel,
+					struct hal_timer *timer)
+{
+	uint64_t tick = timer->expires;
+	uint8_t level;
+
+	/* Expired: called at the next tick */
+	if (tick < wheel->now)
+		tick = wheel->now;
+
+	for (level = 0; level < HAL_TIMER_LEVELS - 1; level++) {
+		if (tick - wheel->now < LEVEL_SPAN(level))
+			break;
+	}
+
+	/* Beyond the wheel: parked in its last slot, inserted again later */
+	if (tick - wheel->now >= LEVEL_SPAN(level))
+		tick = wheel->now + LEVEL_SPAN(level) - 1;
+
+	timer_link(&wheel->slots[level][SLOT_INDEX(tick, level)], timer);
+	timer->level = level;
+	wheel->count[level]++;
+}
+
+/* Timers of the slot are inserted again: lower levels */
+static void timer_cascade(struct hal_timer_wheel *wheel, uint8_t level)
+{
+	struct hal_timer **head;
+	struct hal_timer *list = NULL, *timer;
+
+	head = &wheel->slots[level][SLOT_INDEX(wheel->now, level)];
+	while (*head) {
+		timer = *head;
+		timer_unlink(timer);
+		wheel->count[level]--;
+		timer_link(&list, timer);
+	}
+
+	while (list) {
+		timer = list;
+		timer_unlink(timer);
+		timer_insert(wheel, timer);
+	}
+}
+
+void hal_timer_wheel_init(struct hal_timer_wheel *wheel)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = hal_time64_ms();
+}
+
+void hal_timer_init(struct hal_timer *timer, hal_timer_func func,
+							void *user_data)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->func = func;
+	timer->user_data = user_data;
+}
+
+int hal_timer_pending(const struct hal_timer *timer)
+{
+	return (timer->pprev != NULL);
+}
+
+void hal_timer_cancel(struct hal_timer_wheel *wheel, struct hal_timer *timer)
+{
+	if (!hal_timer_pending(timer))
+		return;
+
+	if (timer->level != LEVEL_NONE)
+		wheel->count[timer->level]--;
+
+	timer_unlink(timer);
+}
+
+void hal_timer_arm(struct hal_timer_wheel *wheel, struct hal_timer *timer,
+							uint32_t ms)
+{
+	hal_timer_cancel(wheel, timer);
+
+	timer->expires = hal_time64_ms() + ms;
+	timer_insert(wheel, timer);
+}
+
+static bool wheel_empty(const struct hal_timer_wheel *wheel)
+{
+	uint8_t level;
+
+	for (level = 0; level < HAL_TIMER_LEVELS; level++) {
+		if (wheel->count[level])
+			return false;
+	}
+
+	return true;
+}
+
+int hal_timer_run(struct hal_timer_wheel *wheel)
+{
+	uint64_t now = hal_time64_ms(), next;
+	struct hal_timer **head, *expired, *timer;
+	uint8_t level;
+	int count = 0;
+
+	while (wheel->now <= now) {
+		if (wheel_empty(wheel)) {
+			wheel->now = now + 1;
+			break;
+		}
+
+		/* Nothing in level 0: up to its wrap (or now) at once */
+		if (wheel->count[0] == 0 && SLOT_INDEX(wheel->now, 0) != 0) {
+			next = (wheel->now | SLOT_MASK) + 1;
+			wheel->now = (next > now + 1 ? now + 1 : next);
+			continue;
+		}
+
+		/* Lower bits wrapped: next slot of the levels above */
+		for (level = 1; level < HAL_TIMER_LEVELS &&
+				SLOT_INDEX(wheel->now, level - 1) == 0; level++)
+			timer_cascade(wheel, level);
+
+		/* Detached: timers armed by the callbacks run next tick */
+		expired = NULL;
+		head = &wheel->slots[0][SLOT_INDEX(wheel->now, 0)];
+		while (*head) {
+			timer = *head;
+			timer_unlink(timer);
+			wheel->count[0]--;
+			timer_link(&expired, timer);
+			timer->level = LEVEL_NONE;
+		}
+
+		wheel->now++;
+
+		while (expired) {
+			timer = expired;
+			timer_unlink(timer);
+			timer->func(timer, timer->user_data);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Earliest expiration of a slot */
+static uint64_t slot_expires(const struct hal_timer *timer, uint64_t min)
+{
+	for (; timer; timer = timer->next) {
+		if (timer->expires < min)
+			min = timer->expires;
+	}
+
+	return min;
+}
+
+int hal_timer_next(const struct hal_timer_wheel *wheel)
+{
+	uint64_t min = UINT64_MAX, now;
+	uint8_t level, i, first, index;
+
+	for (level = 0; level < HAL_TIMER_LEVELS; level++) {
+		if (wheel->count[level] == 0)
+			continue;
+
+		/*
+		 * Slots ahead expire later. The one of the next tick is
+		 * the first unless already cascaded: then it is the last.
+		 */
+		first = (level > 0 && (wheel->now &
+				(LEVEL_SPAN(level - 1) - 1)) != 0);
+
+		for (i = 0; i < HAL_TIMER_SLOTS; i++) {
+			index = (SLOT_INDEX(wheel->now, level) + first + i) &
+								SLOT_MASK;
+			if (wheel->slots[level][index] == NULL)
+				continue;
+
+			min = slot_expires(wheel->slots[level][index], min);
+
+			/* Last level: parked timers may be anywhere */
+			if (level < HAL_TIMER_LEVELS - 1)
+				break;
+		}
+	}
+
+	if (min == UINT64_MAX)
+		return -1;
+
+	/* Expired when armed: called at the next tick, not before */
+	if (min < wheel->now)
+		min = wheel->now;
+
+	now = hal_time64_ms();
+	if (min <= now)
+		return 0;
+
+	return (min - now > INT32_MAX ? INT32_MAX : (int) (min - now));
+}
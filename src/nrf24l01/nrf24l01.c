@@ -20,48 +20,172 @@
 #define TPD2STBY	5000
 #define TSTBY2A		130
 #define	THCEN		10
+/* RPD: valid 40us after TSTBY2A, sampled every TRPD */
+#define TRPD		40
 
 #define NRF24_ADDR_SIZE		5
 
-static bool pipe0_open = false;
-static uint8_t pipe0_address[NRF24_ADDR_SIZE];
+#ifdef ARDUINO
+#define NRF24_RADIO_MAX		1
+#else
+#define NRF24_RADIO_MAX		2
+#endif
+
+/* Radio context: one for each SPI device opened by nrf24l01_init */
+struct nrf24_radio {
+	bool in_use;
+	int8_t spi_fd;
+	bool pipe0_open;
+	uint8_t pipe0_address[NRF24_ADDR_SIZE];
+	bool irq;		/* IRQ driven: see nrf24l01_set_irq */
+	bool irq_pending;	/* RX FIFO may hold data */
+	bool stream;		/* TX streaming: see nrf24l01_ptx_stream_begin */
+	bool stream_err;	/* MAX_RT: stream stopped */
+	uint8_t stream_queued;	/* Payloads loaded */
+	uint8_t stream_done;	/* Payloads acknowledged (TX_DS seen) */
+	uint8_t ack_state;	/* ACK payload: see nrf24l01_prx_ack_data */
+	uint8_t tx_pipe;	/* Pipe of nrf24l01_set_ptx */
+	/* SETUP_RETR of each pipe, 0: by pipe index (nrf24l01_set_retr) */
+	uint8_t retr[NRF24_PIPE_MAX + 1];
+	struct nrf24_observe obs[NRF24_PIPE_MAX + 1];
+	/*
+	 * Shadow of the configuration registers, loaded once by
+	 * nrf24l01_init and written through: reads never reach the bus
+	 * and writes of an unchanged value are skipped. STATUS and
+	 * FIFO_STATUS are changed by the radio itself: not cached.
+	 * Pipes 2 to 5 keep their address LSB in reg[].
+	 */
+	uint8_t reg[NRF24_FEATURE + 1];
+	uint8_t addr[3][NRF24_ADDR_SIZE];	/* P0, P1 and TX addresses */
+	/*
+	 * Pending SPI commands: writes are queued and go to the bus
+	 * along with the next read (or before CE is toggled). Public
+	 * functions leave the batch empty, except nrf24l01_set_ptx: its
+	 * writes are issued with the payload by nrf24l01_ptx_data.
+	 */
+	struct spi_bus_batch batch;
+};
+
+static struct nrf24_radio radios[NRF24_RADIO_MAX];
+
+/* ACK payload state */
+enum {
+	ACK_NONE,
+	ACK_LOADED,		/* In the TX FIFO */
+	ACK_SENT		/* TX_DS: not reported yet */
+};
+
+static struct nrf24_radio *radio_get(int8_t spi_fd)
+{
+	uint8_t i;
+
+	for (i = 0; i < NRF24_RADIO_MAX; i++) {
+		if (radios[i].in_use && radios[i].spi_fd == spi_fd)
+			return &radios[i];
+	}
+
+	/* Not opened through nrf24l01_init: rejected by the callers */
+	return NULL;
+}
+
+static inline bool reg_cached(uint8_t reg)
+{
+	return reg < NRF24_STATUS || reg == NRF24_DYNPD ||
+		reg == NRF24_FEATURE ||
+		(reg >= NRF24_RX_PW_P0 && reg <= NRF24_RX_PW_P5);
+}
+
+static uint8_t *shadow_addr(struct nrf24_radio *radio, uint8_t reg)
+{
+	switch (reg) {
+	case NRF24_RX_ADDR_P0:
+		return radio->addr[0];
+	case NRF24_RX_ADDR_P1:
+		return radio->addr[1];
+	case NRF24_TX_ADDR:
+		return radio->addr[2];
+	default:
+		return &radio->reg[reg];
+	}
+}
 
 /*
  * Send to spi transfer the read command
  * return the value that was read in reg
  */
-static inline int8_t nrf24reg_read(int8_t spi_fd, uint8_t reg)
+static inline int8_t spi_reg_read(int8_t spi_fd, uint8_t reg)
 {
+	struct spi_bus_batch *batch = &radio_get(spi_fd)->batch;
 	uint8_t value = NRF24_NOP;
 
 	reg = NRF24_R_REGISTER(reg);
-	spi_bus_transfer(spi_fd, &reg, DATA_SIZE, &value, DATA_SIZE);
+	spi_bus_append(batch, &reg, DATA_SIZE, &value, DATA_SIZE);
+	spi_bus_commit(batch);
 	return (int8_t)value;
 }
 
+static inline int8_t nrf24reg_read(int8_t spi_fd, uint8_t reg)
+{
+	if (reg_cached(reg))
+		return (int8_t)radio_get(spi_fd)->reg[reg];
+
+	return spi_reg_read(spi_fd, reg);
+}
+
 static inline void nrf24data_read(int8_t spi_fd, uint8_t reg,
 					void *pd, uint16_t len)
 {
+	struct spi_bus_batch *batch = &radio_get(spi_fd)->batch;
+
 	memset(pd, NRF24_NOP, len);
 	reg = NRF24_R_REGISTER(reg);
-	spi_bus_transfer(spi_fd, &reg, DATA_SIZE, pd, len);
+	spi_bus_append(batch, &reg, DATA_SIZE, pd, len);
+	spi_bus_commit(batch);
 }
 
 /*
  * Send to spi transfer the write command
  * and the data that will be written
  */
+static inline void spi_reg_write(int8_t spi_fd, uint8_t reg, uint8_t value)
+{
+	uint8_t cmd[] = { NRF24_W_REGISTER(reg), value };
+
+	spi_bus_append(&radio_get(spi_fd)->batch, cmd, sizeof(cmd), NULL, 0);
+}
+
 static inline void nrf24reg_write(int8_t spi_fd, uint8_t reg, uint8_t value)
 {
-	reg = NRF24_W_REGISTER(reg);
-	spi_bus_transfer(spi_fd, &reg, DATA_SIZE, &value, DATA_SIZE);
+	struct nrf24_radio *radio;
+
+	if (reg_cached(reg)) {
+		radio = radio_get(spi_fd);
+		/* Unchanged: skip the bus access */
+		if (radio->reg[reg] == value)
+			return;
+
+		radio->reg[reg] = value;
+	}
+
+	spi_reg_write(spi_fd, reg, value);
 }
 
+/* Address registers only: up to NRF24_ADDR_SIZE bytes */
 static inline void nrf24data_write(int8_t spi_fd, uint8_t reg,
-					void *pd, uint16_t len)
+					const void *pd, uint16_t len)
+{
+	uint8_t cmd[DATA_SIZE + NRF24_ADDR_SIZE];
+
+	cmd[0] = NRF24_W_REGISTER(reg);
+	memcpy(&cmd[1], pd, len);
+	spi_bus_append(&radio_get(spi_fd)->batch, cmd, DATA_SIZE + len,
+								NULL, 0);
+}
+
+/* Issue the pending writes */
+static inline void flush(int8_t spi_fd)
 {
-	reg = NRF24_W_REGISTER(reg);
-	spi_bus_transfer(spi_fd, &reg, DATA_SIZE, pd, len);
+	spi_bus_commit(&radio_get(spi_fd)->batch);
 }
 
 /*
@@ -70,33 +194,79 @@ static inline void nrf24data_write(int8_t spi_fd, uint8_t reg,
  */
 static inline int8_t command(int8_t spi_fd, uint8_t cmd)
 {
-	spi_bus_transfer(spi_fd, NULL, 0, &cmd, DATA_SIZE);
+	struct spi_bus_batch *batch = &radio_get(spi_fd)->batch;
+
+	spi_bus_append(batch, NULL, 0, &cmd, DATA_SIZE);
+	spi_bus_commit(batch);
 	/* Return device status register */
 	return (int8_t)cmd;
 }
 
+/* STATUS and OBSERVE_TX in the same frame */
+static inline uint8_t observe(int8_t spi_fd, uint8_t *obs)
+{
+	struct spi_bus_batch *batch = &radio_get(spi_fd)->batch;
+	uint8_t rx[] = { NRF24_R_REGISTER(NRF24_OBSERVE_TX), NRF24_NOP };
+
+	spi_bus_append(batch, NULL, 0, rx, sizeof(rx));
+	spi_bus_commit(batch);
+	*obs = rx[1];
+
+	return rx[0];
+}
+
 static inline int8_t command_data(int8_t spi_fd, uint8_t cmd, void *pd,
 						uint16_t len)
 {
-	spi_bus_transfer(spi_fd, &cmd, DATA_SIZE, pd, len);
-	/* Return device status register */
+	spi_bus_append(&radio_get(spi_fd)->batch, &cmd, DATA_SIZE, pd, len);
+	/* Return device status register: same SPI message */
 	return command(spi_fd, NRF24_NOP);
 }
 
-static inline void set_standby1(void)
+/* CE is not on the SPI bus: pending writes must go first */
+static inline void set_standby1(int8_t spi_fd)
+{
+	flush(spi_fd);
+	disable(spi_fd);
+}
+
+static inline void set_active(int8_t spi_fd)
+{
+	flush(spi_fd);
+	enable(spi_fd);
+}
+
+/* PRX: TX_DS is set once the ACK carrying the payload has been sent */
+static void ack_check(int8_t spi_fd, struct nrf24_radio *radio)
+{
+	if (radio->ack_state != ACK_LOADED)
+		return;
+
+	if (!(command(spi_fd, NRF24_NOP) & NRF24_ST_TX_DS))
+		return;
+
+	nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_TX_DS);
+	flush(spi_fd);
+	radio->ack_state = ACK_SENT;
+}
+
+/* TX FIFO is going to be used or flushed: unsent ACK payload is lost */
+static void ack_release(int8_t spi_fd, struct nrf24_radio *radio)
 {
-	disable();
+	ack_check(spi_fd, radio);
+	if (radio->ack_state != ACK_LOADED)
+		return;
+
+	command(spi_fd, NRF24_FLUSH_TX);
+	radio->ack_state = ACK_NONE;
 }
 
 /* Set address in pipe */
 static void set_address_pipe(int8_t spi_fd, uint8_t reg, uint8_t *pipe_addr)
 {
-	uint8_t addr[NRF24_ADDR_SIZE];
+	uint8_t *shadow = shadow_addr(radio_get(spi_fd), reg);
 	int8_t len;
 
-	/* memcpy is necessary because nrf24data_write cleans value after send */
-	memcpy(addr, pipe_addr, sizeof(addr));
-
 	switch (reg) {
 	case NRF24_TX_ADDR:
 	case NRF24_RX_ADDR_P0:
@@ -108,12 +278,18 @@ static void set_address_pipe(int8_t spi_fd, uint8_t reg, uint8_t *pipe_addr)
 		break;
 	}
 
-	nrf24data_write(spi_fd, reg, &addr, len);
+	/* Unchanged: skip the bus access */
+	if (memcmp(shadow, pipe_addr, len) == 0)
+		return;
+
+	memcpy(shadow, pipe_addr, len);
+	nrf24data_write(spi_fd, reg, pipe_addr, len);
 }
 
 /* Get address of pipe */
 static void get_address_pipe(int8_t spi_fd, uint8_t pipe, uint8_t *pipe_addr)
 {
+	struct nrf24_radio *radio = radio_get(spi_fd);
 	int8_t len = NRF24_AW_RD(nrf24reg_read(spi_fd, NRF24_SETUP_AW));
 
 	switch (NRF24_RX_ADDR_PIPE(pipe)) {
@@ -123,12 +299,29 @@ static void get_address_pipe(int8_t spi_fd, uint8_t pipe, uint8_t *pipe_addr)
 		break;
 
 	default:
-		nrf24data_read(spi_fd, NRF24_RX_ADDR_P1, pipe_addr, len);
+		memcpy(pipe_addr, shadow_addr(radio, NRF24_RX_ADDR_P1), len);
 		len = DATA_SIZE;
 		break;
 	}
 
-	nrf24data_read(spi_fd, NRF24_RX_ADDR_PIPE(pipe), pipe_addr, len);
+	memcpy(pipe_addr, shadow_addr(radio, NRF24_RX_ADDR_PIPE(pipe)), len);
+}
+
+/* Load the shadow registers from the radio */
+static void shadow_load(struct nrf24_radio *radio)
+{
+	uint8_t reg, len;
+
+	for (reg = 0; reg <= NRF24_FEATURE; reg++) {
+		if (reg_cached(reg))
+			radio->reg[reg] = spi_reg_read(radio->spi_fd, reg);
+	}
+
+	len = NRF24_AW_RD(radio->reg[NRF24_SETUP_AW]);
+	for (reg = NRF24_RX_ADDR_P0; reg <= NRF24_TX_ADDR; reg++)
+		nrf24data_read(radio->spi_fd, reg, shadow_addr(radio, reg),
+				(reg <= NRF24_RX_ADDR_P1 || reg == NRF24_TX_ADDR) ?
+				len : DATA_SIZE);
 }
 
 /*
@@ -138,19 +331,39 @@ static void get_address_pipe(int8_t spi_fd, uint8_t pipe, uint8_t *pipe_addr)
  */
 int8_t nrf24l01_init(const char *dev, uint8_t tx_pwr)
 {
-	uint8_t	value;
+	struct nrf24_radio *radio = NULL;
+	uint8_t	value, i;
 	int8_t spi_fd;
 
+	for (i = 0; i < NRF24_RADIO_MAX; i++) {
+		if (!radios[i].in_use) {
+			radio = &radios[i];
+			break;
+		}
+	}
+
+	/* No free radio context */
+	if (radio == NULL)
+		return -1;
+
 	/* example of dev = "/dev/spidev0.0" */
 	spi_fd = io_setup(dev);
 	if (spi_fd < 0)
 		return spi_fd;
 
+	memset(radio, 0, sizeof(*radio));
+	radio->in_use = true;
+	radio->spi_fd = spi_fd;
+	spi_bus_begin(&radio->batch, spi_fd);
+
 	/* Reset device in power down mode */
-	nrf24reg_write(spi_fd, NRF24_CONFIG, NRF24_CONFIG_RST);
+	spi_reg_write(spi_fd, NRF24_CONFIG, NRF24_CONFIG_RST);
+	flush(spi_fd);
 	/* Delay to establish to operational timing of the nRF24L01 */
 	delay_us(TPD2STBY);
 
+	shadow_load(radio);
+
 	/* Set device to standby-I mode */
 	value = nrf24reg_read(spi_fd, NRF24_CONFIG) & ~NRF24_CONFIG_MASK;
 	value |= NRF24_CFG_MASK_RX_DR | NRF24_CFG_MASK_TX_DS;
@@ -227,18 +440,57 @@ int8_t nrf24l01_init(const char *dev, uint8_t tx_pwr)
 
 int8_t nrf24l01_deinit(int8_t spi_fd)
 {
-	set_standby1();
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL)
+		return -1;
+
+	set_standby1(spi_fd);
 	/* Power down the radio */
 	nrf24reg_write(spi_fd, NRF24_CONFIG,
 			nrf24reg_read(spi_fd, NRF24_CONFIG) &
 			~NRF24_CFG_PWR_UP);
+	flush(spi_fd);
 
 	/* Deinit SPI and GPIO */
 	io_reset(spi_fd);
 
+	radio->in_use = false;
+
 	return 0;
 }
 
+/*
+ * nrf24l01_set_irq:
+ * Unmask RX_DR, TX_DS and MAX_RT interrupts. The RX FIFO is only
+ * read after an IRQ edge, until it is found empty again.
+ * Returns the fd to be watched (hal_gpio_poll_events()) or a negative
+ * value.
+ */
+int nrf24l01_set_irq(int8_t spi_fd)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+	int irq_fd;
+
+	if (radio == NULL)
+		return -1;
+
+	irq_fd = io_irq_setup(spi_fd);
+	if (irq_fd < 0)
+		return irq_fd;
+
+	nrf24reg_write(spi_fd, NRF24_CONFIG,
+			nrf24reg_read(spi_fd, NRF24_CONFIG) &
+			~(NRF24_CFG_MASK_RX_DR | NRF24_CFG_MASK_TX_DS |
+			  NRF24_CFG_MASK_MAX_RT));
+	flush(spi_fd);
+
+	radio->irq = true;
+	radio->irq_pending = true;
+
+	return irq_fd;
+}
+
 /*
  * nrf24l01_set_channel:
  * Bandwidth < 1MHz at 250kbps
@@ -250,15 +502,22 @@ int8_t nrf24l01_deinit(int8_t spi_fd)
  */
 int8_t nrf24l01_set_channel(int8_t spi_fd, uint8_t ch, bool ack)
 {
-	uint8_t max  = NRF24_RF_DR(nrf24reg_read(spi_fd, NRF24_RF_SETUP)) ==
+	struct nrf24_radio *radio = radio_get(spi_fd);
+	uint8_t max;
+
+	if (radio == NULL)
+		return -1;
+
+	max = NRF24_RF_DR(nrf24reg_read(spi_fd, NRF24_RF_SETUP)) ==
 			NRF24_DR_2MBPS?NRF24_CH_MAX_2MBPS:NRF24_CH_MAX_1MBPS;
 
 	if (ch != _CONSTRAIN(ch, NRF24_CH_MIN, max))
 		return -1;
 
-	set_standby1();
+	set_standby1(spi_fd);
 
 	if (ch != NRF24_CH(nrf24reg_read(spi_fd, NRF24_RF_CH))) {
+		ack_release(spi_fd, radio);
 		nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_RX_DR
 			| NRF24_ST_TX_DS | NRF24_ST_MAX_RT);
 		command(spi_fd, NRF24_FLUSH_TX);
@@ -276,6 +535,8 @@ int8_t nrf24l01_set_channel(int8_t spi_fd, uint8_t ch, bool ack)
 		nrf24reg_write(spi_fd, NRF24_EN_AA,
 				nrf24reg_read(spi_fd, NRF24_EN_AA) & ~NRF24_EN_AA_MASK);
 
+	flush(spi_fd);
+
 	return 0;
 }
 
@@ -285,7 +546,10 @@ int8_t nrf24l01_set_channel(int8_t spi_fd, uint8_t ch, bool ack)
  */
 int8_t nrf24l01_set_standby(int8_t spi_fd)
 {
-	set_standby1();
+	if (radio_get(spi_fd) == NULL)
+		return -1;
+
+	set_standby1(spi_fd);
 	return command(spi_fd, NRF24_NOP);
 }
 
@@ -296,10 +560,11 @@ int8_t nrf24l01_set_standby(int8_t spi_fd)
  */
 int8_t nrf24l01_open_pipe(int8_t spi_fd, uint8_t pipe, uint8_t *pipe_addr)
 {
+	struct nrf24_radio *radio = radio_get(spi_fd);
 	uint8_t value;
 
 	/* Out of range? */
-	if (pipe > NRF24_PIPE_MAX)
+	if (radio == NULL || pipe > NRF24_PIPE_MAX)
 		return -1;
 
 	/* Enable pipe */
@@ -310,8 +575,9 @@ int8_t nrf24l01_open_pipe(int8_t spi_fd, uint8_t pipe, uint8_t *pipe_addr)
 		set_address_pipe(spi_fd, NRF24_RX_ADDR_PIPE(pipe), pipe_addr);
 		/* Hold pipe0 address whether case on */
 		if (pipe == NRF24_PIPE0_ADDR) {
-			memcpy(pipe0_address, pipe_addr, sizeof(pipe0_address));
-			pipe0_open = true;
+			memcpy(radio->pipe0_address, pipe_addr,
+					sizeof(radio->pipe0_address));
+			radio->pipe0_open = true;
 		} else {
 			/*
 			 * Applied to pipe 2 to 5:
@@ -322,6 +588,7 @@ int8_t nrf24l01_open_pipe(int8_t spi_fd, uint8_t pipe, uint8_t *pipe_addr)
 					!(value & NRF24_EN_RXADDR_P1))
 				set_address_pipe(spi_fd, NRF24_RX_ADDR_P1, pipe_addr);
 		}
+		flush(spi_fd);
 	}
 
 	return 0;
@@ -333,8 +600,10 @@ int8_t nrf24l01_open_pipe(int8_t spi_fd, uint8_t pipe, uint8_t *pipe_addr)
  */
 int8_t nrf24l01_close_pipe(int8_t spi_fd, int8_t pipe)
 {
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
 	/* Out of range? */
-	if (pipe < NRF24_PIPE_MIN || pipe > NRF24_PIPE_MAX)
+	if (radio == NULL || pipe < NRF24_PIPE_MIN || pipe > NRF24_PIPE_MAX)
 		return -1;
 
 	if (nrf24reg_read(spi_fd, NRF24_EN_RXADDR) & NRF24_EN_RXADDR_PIPE(pipe)) {
@@ -346,7 +615,8 @@ int8_t nrf24l01_close_pipe(int8_t spi_fd, int8_t pipe)
 				nrf24reg_read(spi_fd, NRF24_EN_RXADDR)
 				& ~NRF24_EN_RXADDR_PIPE(pipe));
 		if (pipe == NRF24_PIPE0_ADDR)
-			pipe0_open = false;
+			radio->pipe0_open = false;
+		flush(spi_fd);
 	}
 
 	return 0;
@@ -361,14 +631,17 @@ int8_t nrf24l01_close_pipe(int8_t spi_fd, int8_t pipe)
  */
 int8_t nrf24l01_set_ptx(int8_t spi_fd, uint8_t pipe)
 {
+	struct nrf24_radio *radio = radio_get(spi_fd);
 	uint8_t pipe_addr[NRF24_ADDR_SIZE];
 
 	/* Out of range? */
-	if (pipe > NRF24_PIPE_MAX)
+	if (radio == NULL || pipe > NRF24_PIPE_MAX)
 		return -1;
 
 	/* Switch radio to standby-1 */
-	set_standby1();
+	set_standby1(spi_fd);
+	ack_release(spi_fd, radio);
+	radio->tx_pipe = pipe;
 
 	/* TX Settling */
 
@@ -389,9 +662,10 @@ int8_t nrf24l01_set_ptx(int8_t spi_fd, uint8_t pipe)
 		* pipe 3 - 1250us
 		* pipe 4 - 1500us
 		* pipe 5 - 1750us
+		* unless set by nrf24l01_set_retr.
 		*/
-		nrf24reg_write(spi_fd, NRF24_SETUP_RETR,
-			NRF24_RETR_ARD((pipe + 1))
+		nrf24reg_write(spi_fd, NRF24_SETUP_RETR, radio->retr[pipe] ?
+			radio->retr[pipe] : NRF24_RETR_ARD((pipe + 1))
 			| NRF24_RETR_ARC(NRF24_ARC));
 	} else {
 		/* Disable Auto Re-transmission Count */
@@ -409,9 +683,13 @@ int8_t nrf24l01_set_ptx(int8_t spi_fd, uint8_t pipe)
 	}
 	set_address_pipe(spi_fd, NRF24_TX_ADDR, pipe_addr);
 
-	/* Set PTX mode */
-	nrf24reg_write(spi_fd, NRF24_STATUS,
-			NRF24_ST_TX_DS | NRF24_ST_MAX_RT);
+	/*
+	 * Set PTX mode. IRQ driven: RX_DR must be cleared too, otherwise
+	 * IRQ line stays low and TX completion has no edge. nrf24l01_set_prx
+	 * checks the RX FIFO again anyway.
+	 */
+	nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_TX_DS | NRF24_ST_MAX_RT |
+			(radio->irq ? NRF24_ST_RX_DR : 0));
 	nrf24reg_write(spi_fd, NRF24_CONFIG,
 			nrf24reg_read(spi_fd, NRF24_CONFIG) & ~NRF24_CFG_PRIM_RX);
 
@@ -426,6 +704,9 @@ int8_t nrf24l01_ptx_data(int8_t spi_fd, void *pdata, uint16_t len)
 {
 	uint8_t st;
 
+	if (radio_get(spi_fd) == NULL)
+		return -1;
+
 	if (pdata == NULL || len == 0 || len > NRF24_PAYLOAD_SIZE)
 		return -1;
 
@@ -438,15 +719,41 @@ int8_t nrf24l01_ptx_data(int8_t spi_fd, void *pdata, uint16_t len)
 			pdata, len));
 	if (st == 0) {
 		/* Trigger PTX mode */
-		enable();
+		set_active(spi_fd);
 		delay_us(THCEN);
-		set_standby1();
+		set_standby1(spi_fd);
 		delay_us(TSTBY2A-THCEN);
 	}
 
 	return (int8_t)st;
 }
 
+/*
+ * TX completion: longer than ARC x ARD of any pipe. Without IRQ
+ * STATUS is polled at TX_POLL intervals.
+ */
+#define TX_TIMEOUT	50	/* ms */
+#define TX_POLL		100	/* us */
+
+/*
+ * Sleeps until the radio may have a TX event (TX_DS or MAX_RT): IRQ
+ * edge if unmasked, otherwise a polling interval. Returns -1 once
+ * TX_TIMEOUT expires without any: the radio is wedged.
+ */
+static int8_t tx_wait(int8_t spi_fd, struct nrf24_radio *radio,
+							uint16_t *polls)
+{
+	if (radio->irq)
+		return io_irq_wait(spi_fd, TX_TIMEOUT) > 0 ? 0 : -1;
+
+	if (++(*polls) > (TX_TIMEOUT * 1000UL) / TX_POLL)
+		return -1;
+
+	delay_us(TX_POLL);
+
+	return 0;
+}
+
 /*
  * nrf24l01_ptx_wait_datasent:
  * wait while data is being sent
@@ -454,20 +761,204 @@ int8_t nrf24l01_ptx_data(int8_t spi_fd, void *pdata, uint16_t len)
  */
 int8_t nrf24l01_ptx_wait_datasent(int8_t spi_fd)
 {
-	uint8_t value;
+	struct nrf24_radio *radio = radio_get(spi_fd);
+	struct nrf24_observe *obs;
+	uint16_t polls = 0;
+	uint8_t value, arc;
+
+	if (radio == NULL)
+		return -1;
+
+	obs = &radio->obs[radio->tx_pipe];
+
+	while (1) {
+		/* STATUS is clocked out with any command */
+		value = observe(spi_fd, &arc);
+		if (value & (NRF24_ST_TX_DS | NRF24_ST_MAX_RT))
+			obs->retries += NRF24_OBS_ARC(arc);
+
+		if (value & NRF24_ST_TX_DS) {
+			/*
+			 * IRQ driven: an ACK payload sets RX_DR as well, the
+			 * IRQ line would stay low. The payload is left in
+			 * the RX FIFO, nrf24l01_set_prx checks it again.
+			 */
+			if (radio->irq) {
+				nrf24reg_write(spi_fd, NRF24_STATUS,
+					NRF24_ST_TX_DS | NRF24_ST_RX_DR);
+				flush(spi_fd);
+			}
+			obs->sent++;
+			return 0;
+		}
 
-	do {
-		value = nrf24reg_read(spi_fd, NRF24_STATUS);
 		/* Send failed: Max number of TX retransmits? */
-		if (value & NRF24_ST_MAX_RT) {
-			command(spi_fd, NRF24_FLUSH_TX);
+		if (value & NRF24_ST_MAX_RT)
+			break;
+
+		if (tx_wait(spi_fd, radio, &polls) < 0)
+			break;
+	}
+
+	obs->lost++;
+	command(spi_fd, NRF24_FLUSH_TX);
+
+	return -1;
+}
+
+/* TX FIFO depth */
+#define TX_FIFO_SIZE	3
+
+/* Counts TX_DS (merged edges are missed) and flags MAX_RT */
+static uint8_t stream_poll(int8_t spi_fd, struct nrf24_radio *radio)
+{
+	uint8_t arc, st = observe(spi_fd, &arc);
+
+	if (st & (NRF24_ST_TX_DS | NRF24_ST_MAX_RT))
+		radio->obs[radio->tx_pipe].retries += NRF24_OBS_ARC(arc);
+
+	/* ACK payload: RX_DR is acknowledged, see ptx_wait_datasent */
+	if (st & NRF24_ST_TX_DS) {
+		nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_TX_DS |
+				(radio->irq ? NRF24_ST_RX_DR : 0));
+		flush(spi_fd);
+		radio->stream_done++;
+	}
+
+	if (st & NRF24_ST_MAX_RT)
+		radio->stream_err = true;
+
+	return st;
+}
+
+/*
+ * nrf24l01_ptx_stream_begin:
+ * Back-to-back transmission to a pipe: the radio switches to PTX once
+ * and CE is held high, payloads loaded by nrf24l01_ptx_stream_data are
+ * sent as soon as the previous one is acknowledged, without PTX/PRX
+ * settling in between.
+ */
+int8_t nrf24l01_ptx_stream_begin(int8_t spi_fd, uint8_t pipe)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL || nrf24l01_set_ptx(spi_fd, pipe) < 0)
+		return -1;
+
+	radio->stream = true;
+	radio->stream_err = false;
+	radio->stream_queued = 0;
+	radio->stream_done = 0;
+
+	/* Standby-II: TX starts when the first payload is loaded */
+	set_active(spi_fd);
+
+	return 0;
+}
+
+bool nrf24l01_ptx_streaming(int8_t spi_fd)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	return (radio != NULL && radio->stream);
+}
+
+/*
+ * nrf24l01_ptx_stream_data:
+ * Load a payload, waiting for room in the TX FIFO. Returns -1 once a
+ * payload has not been acknowledged: the remaining ones are not sent.
+ */
+int8_t nrf24l01_ptx_stream_data(int8_t spi_fd, void *pdata, uint16_t len)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+	uint16_t polls = 0;
+
+	if (pdata == NULL || len == 0 || len > NRF24_PAYLOAD_SIZE)
+		return -1;
+
+	if (radio == NULL || !radio->stream || radio->stream_err)
+		return -1;
+
+	/* FIFO may be full: wait for an ACK or MAX_RT */
+	while ((uint8_t) (radio->stream_queued - radio->stream_done) >=
+							TX_FIFO_SIZE) {
+		if (!ST_TX_FULL(stream_poll(spi_fd, radio)))
+			break;
+
+		if (radio->stream_err)
+			return -1;
+
+		if (tx_wait(spi_fd, radio, &polls) < 0) {
+			radio->stream_err = true;
 			return -1;
 		}
-	} while(!(value & NRF24_ST_TX_DS));
+	}
+
+	command_data(spi_fd, NRF24_W_TX_PAYLOAD, pdata, len);
+	radio->stream_queued++;
 
 	return 0;
 }
 
+/*
+ * nrf24l01_ptx_stream_end:
+ * Wait for the TX FIFO to drain and leave the radio in standby-I.
+ * Returns how many payloads, in load order, have been acknowledged.
+ * On MAX_RT the count is a lower bound: TX_DS edges may merge and the
+ * FIFO level is only known when full. Payloads reported as lost may
+ * have been received: retransmissions must be harmless.
+ */
+int8_t nrf24l01_ptx_stream_end(int8_t spi_fd)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+	uint16_t polls = 0;
+	uint8_t fifo, acked;
+
+	if (radio == NULL || !radio->stream)
+		return -1;
+
+	while (!radio->stream_err) {
+		fifo = spi_reg_read(spi_fd, NRF24_FIFO_STATUS);
+		if (fifo & NRF24_FIFO_TX_EMPTY) {
+			radio->stream_done = radio->stream_queued;
+			break;
+		}
+
+		/* Progress: timeout restarts */
+		if (stream_poll(spi_fd, radio) & NRF24_ST_TX_DS) {
+			polls = 0;
+			continue;
+		}
+
+		if (!radio->stream_err && tx_wait(spi_fd, radio, &polls) < 0)
+			radio->stream_err = true;
+	}
+
+	set_standby1(spi_fd);
+	radio->stream = false;
+
+	acked = _MIN(radio->stream_done, radio->stream_queued);
+	if (!radio->stream_err) {
+		radio->obs[radio->tx_pipe].sent += acked;
+		return (int8_t)acked;
+	}
+
+	/* Failed payload and the next ones are still in the FIFO */
+	fifo = spi_reg_read(spi_fd, NRF24_FIFO_STATUS);
+	fifo = (fifo & NRF24_FIFO_TX_FULL) ? TX_FIFO_SIZE : TX_FIFO_SIZE - 1;
+	if (radio->stream_queued > fifo && radio->stream_queued - fifo > acked)
+		acked = radio->stream_queued - fifo;
+
+	radio->obs[radio->tx_pipe].sent += acked;
+	radio->obs[radio->tx_pipe].lost++;
+
+	command(spi_fd, NRF24_FLUSH_TX);
+	nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_MAX_RT | NRF24_ST_TX_DS);
+	flush(spi_fd);
+
+	return (int8_t)acked;
+}
+
 /*
  * nrf24l01_set_prx:
  * set pipe to receive data;
@@ -475,24 +966,41 @@ int8_t nrf24l01_ptx_wait_datasent(int8_t spi_fd)
  */
 int8_t nrf24l01_set_prx(int8_t spi_fd)
 {
-	set_standby1();
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL)
+		return -1;
+
+	set_standby1(spi_fd);
 	/*
 	 * The statement line recover pipe 0 address case
 	 * Auto Acknowledgment is ON.
 	 */
-	if (pipe0_open)
-		set_address_pipe(spi_fd, NRF24_RX_ADDR_P0, pipe0_address);
+	if (radio->pipe0_open)
+		set_address_pipe(spi_fd, NRF24_RX_ADDR_P0,
+						radio->pipe0_address);
 	else
 		nrf24reg_write(spi_fd, NRF24_EN_RXADDR,
 			nrf24reg_read(spi_fd, NRF24_EN_RXADDR)
 						& ~NRF24_EN_RXADDR_P0);
 
-	/* Set PRX mode */
-	nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_RX_DR);
+	/*
+	 * Set PRX mode. TX_DS/MAX_RT must be cleared too when the IRQ
+	 * is unmasked, otherwise IRQ line stays low: no more edges.
+	 */
+	if (radio->irq) {
+		ack_check(spi_fd, radio);
+		nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_RX_DR |
+				NRF24_ST_TX_DS | NRF24_ST_MAX_RT);
+		/* RX_DR of data already in the FIFO has been lost */
+		radio->irq_pending = true;
+	} else {
+		nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_RX_DR);
+	}
 	nrf24reg_write(spi_fd, NRF24_CONFIG,
 			nrf24reg_read(spi_fd, NRF24_CONFIG) | NRF24_CFG_PRIM_RX);
 	/* Trigger PRX mode */
-	enable();
+	set_active(spi_fd);
 	delay_us(TSTBY2A);
 
 	return 0;
@@ -504,13 +1012,30 @@ int8_t nrf24l01_set_prx(int8_t spi_fd)
  */
 int8_t nrf24l01_prx_pipe_available(int8_t spi_fd)
 {
+	struct nrf24_radio *radio = radio_get(spi_fd);
 	uint8_t pipe = NRF24_NO_PIPE;
 
+	/* Unknown radio: nothing to be read */
+	if (radio == NULL)
+		return (int8_t)pipe;
+
+	/* IRQ driven: skip SPI access if there isn't a new edge */
+	if (radio->irq) {
+		if (io_irq_event(spi_fd) != 0)
+			radio->irq_pending = true;
+
+		if (!radio->irq_pending)
+			return (int8_t)pipe;
+	}
+
 	if (!(nrf24reg_read(spi_fd, NRF24_FIFO_STATUS) &
 						NRF24_FIFO_RX_EMPTY)) {
 		pipe = NRF24_ST_RX_P_NO(nrf24reg_read(spi_fd, NRF24_STATUS));
 		if (pipe > NRF24_PIPE_MAX)
 			pipe = NRF24_NO_PIPE;
+	} else {
+		/* Drained: wait for the next RX_DR edge */
+		radio->irq_pending = false;
 	}
 
 	return (int8_t)pipe;
@@ -524,6 +1049,10 @@ int8_t nrf24l01_prx_pipe_available(int8_t spi_fd)
 int8_t nrf24l01_prx_data(int8_t spi_fd, void *pdata, uint16_t len)
 {
 	uint8_t rxlen = 0;
+	uint8_t cmd;
+
+	if (radio_get(spi_fd) == NULL)
+		return -1;
 
 	command_data(spi_fd, NRF24_R_RX_PL_WID, &rxlen, DATA_SIZE);
 
@@ -533,11 +1062,171 @@ int8_t nrf24l01_prx_data(int8_t spi_fd, void *pdata, uint16_t len)
 		rxlen = 0;
 	} else if (rxlen != 0) {
 		rxlen = _MIN(len, rxlen);
-		command_data(spi_fd, NRF24_R_RX_PAYLOAD, pdata, rxlen);
+		cmd = NRF24_R_RX_PAYLOAD;
+		spi_bus_append(&radio_get(spi_fd)->batch, &cmd, DATA_SIZE,
+							pdata, rxlen);
 	}
 
-	/* Reset Rx status */
+	/* Reset Rx status: same SPI message as the payload */
 	nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_RX_DR);
+	flush(spi_fd);
 
 	return (int8_t)rxlen;
 }
+
+/*
+ * nrf24l01_set_ack_payload:
+ * EN_ACK_PAY: PRX may return a payload with the ACK and PTX accepts
+ * it (placed in the RX FIFO as received on pipe 0).
+ */
+int8_t nrf24l01_set_ack_payload(int8_t spi_fd, bool enable)
+{
+	uint8_t value;
+
+	if (radio_get(spi_fd) == NULL)
+		return -1;
+
+	value = nrf24reg_read(spi_fd, NRF24_FEATURE);
+	if (enable)
+		value |= NRF24_FT_EN_ACK_PAY;
+	else
+		value &= ~NRF24_FT_EN_ACK_PAY;
+
+	nrf24reg_write(spi_fd, NRF24_FEATURE, value);
+	flush(spi_fd);
+
+	return 0;
+}
+
+/*
+ * nrf24l01_prx_ack_data:
+ * Load the payload of the next ACK sent on pipe. Only one is loaded at
+ * a time (TX_DS does not tell the pipe): the previous one is dropped
+ * if not sent yet. Switching to PTX also drops it.
+ */
+int8_t nrf24l01_prx_ack_data(int8_t spi_fd, uint8_t pipe, void *pdata,
+							uint16_t len)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL || pipe > NRF24_PIPE_MAX || pdata == NULL ||
+					len == 0 || len > NRF24_PAYLOAD_SIZE)
+		return -1;
+
+	if (!(nrf24reg_read(spi_fd, NRF24_FEATURE) & NRF24_FT_EN_ACK_PAY))
+		return -1;
+
+	ack_release(spi_fd, radio);
+
+	nrf24reg_write(spi_fd, NRF24_STATUS, NRF24_ST_TX_DS);
+	command_data(spi_fd, NRF24_W_ACK_PAYLOAD(pipe), pdata, len);
+	radio->ack_state = ACK_LOADED;
+
+	return 0;
+}
+
+/*
+ * nrf24l01_prx_ack_status:
+ * Returns 1 once the ACK payload has been sent, 0 while it is loaded
+ * or -1 if there isn't any (never loaded, reported or dropped).
+ */
+int8_t nrf24l01_prx_ack_status(int8_t spi_fd)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL)
+		return -1;
+
+	ack_check(spi_fd, radio);
+
+	switch (radio->ack_state) {
+	case ACK_LOADED:
+		return 0;
+	case ACK_SENT:
+		radio->ack_state = ACK_NONE;
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+int8_t nrf24l01_prx_ack_drop(int8_t spi_fd)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL)
+		return -1;
+
+	ack_release(spi_fd, radio);
+	radio->ack_state = ACK_NONE;
+
+	return 0;
+}
+
+/*
+ * nrf24l01_set_retr:
+ * Auto retransmission of the next transmissions to pipe: delay of
+ * (ard + 1) x 250us, within NRF24_ARD_MIN and NRF24_ARD_MAX, up to arc
+ * times. arc 0 restores the default: delay by pipe index, NRF24_ARC.
+ */
+int8_t nrf24l01_set_retr(int8_t spi_fd, uint8_t pipe, uint8_t ard,
+							uint8_t arc)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL || pipe > NRF24_PIPE_MAX)
+		return -1;
+
+	if (arc == 0) {
+		radio->retr[pipe] = 0;
+		return 0;
+	}
+
+	ard = _CONSTRAIN(ard, NRF24_ARD_MIN, NRF24_ARD_MAX);
+	radio->retr[pipe] = NRF24_RETR_ARD(ard) |
+				NRF24_RETR_ARC(_MIN(arc, NRF24_ARC));
+
+	return 0;
+}
+
+/*
+ * nrf24l01_ptx_observe:
+ * Copies the PTX counters of pipe (OBSERVE_TX, read along with STATUS
+ * while waiting for TX completion) and clears them.
+ */
+int8_t nrf24l01_ptx_observe(int8_t spi_fd, uint8_t pipe,
+					struct nrf24_observe *obs)
+{
+	struct nrf24_radio *radio = radio_get(spi_fd);
+
+	if (radio == NULL || pipe > NRF24_PIPE_MAX || obs == NULL)
+		return -1;
+
+	*obs = radio->obs[pipe];
+	memset(&radio->obs[pipe], 0, sizeof(radio->obs[pipe]));
+
+	return 0;
+}
+
+/*
+ * nrf24l01_prx_rpd:
+ * Received Power Detector of the channel being listened (PRX): sampled
+ * every TRPD us. Returns how many samples (up to 127) saw a carrier.
+ */
+int8_t nrf24l01_prx_rpd(int8_t spi_fd, uint8_t samples)
+{
+	int8_t busy = 0;
+
+	if (radio_get(spi_fd) == NULL)
+		return -1;
+
+	samples = _MIN(samples, INT8_MAX);
+
+	for (; samples > 0; samples--) {
+		delay_us(TRPD);
+		if (nrf24reg_read(spi_fd, NRF24_RPD) & NRF24_RPD_MASK)
+			busy++;
+	}
+
+	return busy;
+}
@@ -22,6 +22,10 @@
 /* Auto Retransmit Delay => 4 ms */
 #define NRF24_ARD		NRF24_ARD_40000US
 
+/* Auto Retransmit Delay range of nrf24l01_set_retr: 500us to 2250us */
+#define NRF24_ARD_MIN		NRF24_ARD_500US
+#define NRF24_ARD_MAX		8
+
 #define NRF24_PIPE_MIN			0
 #define NRF24_PIPE_MAX			5
 #define NRF24_PIPE0_ADDR		0
@@ -42,23 +46,45 @@
 #define _CONSTRAIN(x, l, h)	((x) < (l) ? (l) : ((x) > (h) ? (h) : (x)))
 #define _MIN(a, b)		((a) < (b) ? (a) : (b))
 
+/* PTX counters of a pipe: see nrf24l01_ptx_observe */
+struct nrf24_observe {
+	uint16_t sent;		/* Acknowledged */
+	uint16_t lost;		/* MAX_RT or no TX completion */
+	uint16_t retries;	/* ARC_CNT: lower bound when streaming */
+};
+
 #ifdef __cplusplus
 extern "C"{
 #endif
 
 int8_t nrf24l01_init(const char *dev, uint8_t tx_pwr);
 int8_t nrf24l01_deinit(int8_t spi_fd);
+int nrf24l01_set_irq(int8_t spi_fd);
 int8_t nrf24l01_set_channel(int8_t spi_fd, uint8_t ch, bool ack);
 int8_t nrf24l01_set_standby(int8_t spi_fd);
 int8_t nrf24l01_open_pipe(int8_t spi_fd, uint8_t pipe,
 						uint8_t *pipe_addr);
 int8_t nrf24l01_close_pipe(int8_t spi_fd, int8_t pipe);
 int8_t nrf24l01_set_ptx(int8_t spi_fd, uint8_t pipe);
+int8_t nrf24l01_set_retr(int8_t spi_fd, uint8_t pipe, uint8_t ard,
+							uint8_t arc);
+int8_t nrf24l01_ptx_observe(int8_t spi_fd, uint8_t pipe,
+					struct nrf24_observe *obs);
 int8_t nrf24l01_ptx_data(int8_t spi_fd, void *pdata, uint16_t len);
 int8_t nrf24l01_ptx_wait_datasent(int8_t spi_fd);
+int8_t nrf24l01_ptx_stream_begin(int8_t spi_fd, uint8_t pipe);
+bool nrf24l01_ptx_streaming(int8_t spi_fd);
+int8_t nrf24l01_ptx_stream_data(int8_t spi_fd, void *pdata, uint16_t len);
+int8_t nrf24l01_ptx_stream_end(int8_t spi_fd);
 int8_t nrf24l01_set_prx(int8_t spi_fd);
 int8_t nrf24l01_prx_pipe_available(int8_t spi_fd);
 int8_t nrf24l01_prx_data(int8_t spi_fd, void *pdata, uint16_t len);
+int8_t nrf24l01_set_ack_payload(int8_t spi_fd, bool enable);
+int8_t nrf24l01_prx_ack_data(int8_t spi_fd, uint8_t pipe, void *pdata,
+							uint16_t len);
+int8_t nrf24l01_prx_ack_status(int8_t spi_fd);
+int8_t nrf24l01_prx_ack_drop(int8_t spi_fd);
+int8_t nrf24l01_prx_rpd(int8_t spi_fd, uint8_t samples);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -38,6 +38,18 @@
 #define NRF24_TX_FIFO_FULL			0b1
 /* Read TX FIFO full flag */
 #define ST_TX_FULL(v)			((v) & NRF24_ST_TX_FULL)
+
+/* Transmit observe (read only, PLOS_CNT reset by writing RF_CH) */
+#define NRF24_OBSERVE_TX	0x08
+#define NRF24_OBS_PLOS_MASK	0b11110000
+#define NRF24_OBS_PLOS(v)	(((v) & NRF24_OBS_PLOS_MASK) >> 4)
+#define NRF24_OBS_ARC_MASK	0b00001111
+/* Retransmissions of the current (or last) packet */
+#define NRF24_OBS_ARC(v)	((v) & NRF24_OBS_ARC_MASK)
+
+/* Received Power Detector (read only): carrier above -64dBm in RX mode */
+#define NRF24_RPD		0x09
+#define NRF24_RPD_MASK		0b00000001
 /*
  * Enable dynamic payload length (reset value: 0b00000000)
  * (requires EN_DLL in FEATURE and AA_Px in ENAA enabled)
@@ -242,9 +254,12 @@ extern "C"{
 
 /* IO functions*/
 void delay_us(float us);
-void enable(void);
-void disable(void);
+void enable(int spi_fd);
+void disable(int spi_fd);
 int io_setup(const char *dev);
+int io_irq_setup(int spi_fd);
+int io_irq_event(int spi_fd);
+int io_irq_wait(int spi_fd, int timeout_ms);
 void io_reset(int spi_fd);
 
 
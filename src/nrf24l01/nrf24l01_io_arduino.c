@@ -21,13 +21,13 @@ void delay_us(float us)
 	delayMicroseconds(us);
 }
 
-void enable(void)
+void enable(int spi_fd)
 {
 	PORTB |= (1 << CE);
 	delayMicroseconds(TPECE2CSN);
 }
 
-void disable(void)
+void disable(int spi_fd)
 {
 	PORTB &= ~(1 << CE);
 }
@@ -41,12 +41,28 @@ int io_setup(const char *dev)
 	PORTB &= ~(1 << CE);
 	/* PB1 as output */
 	DDRB |= (1 << CE);
-	disable();
+	disable(0);
 	return spi_bus_init("");
 }
 
+/* IRQ pin is not wired: the radio is polled */
+int io_irq_setup(int spi_fd)
+{
+	return -1;
+}
+
+int io_irq_event(int spi_fd)
+{
+	return 1;
+}
+
+int io_irq_wait(int spi_fd, int timeout_ms)
+{
+	return 1;
+}
+
 void io_reset(int spi_fd)
 {
-	disable();
+	disable(spi_fd);
 	spi_bus_deinit(spi_fd);
 }
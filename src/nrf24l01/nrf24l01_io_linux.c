@@ -7,57 +7,221 @@
  *
  */
 
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include "hal/gpio_sysfs.h"
+#include "hal/time.h"
 #include "nrf24l01_io.h"
 #include "spi_bus.h"
 
-#define CE	25
-#define IRQ	24
-
 /* Time delay in microseconds (us) */
 #define	TPECE2CSN		4
 
+/*
+ * GPIO wiring of each radio: one radio for each SPI chip select.
+ * The first radio (/dev/spidev0.0) uses CE on GPIO 25 and IRQ on
+ * GPIO 24, the second one (/dev/spidev0.1) uses GPIO 22 and GPIO 27.
+ */
+struct nrf24_io {
+	const char *dev;
+	uint8_t ce;
+	uint8_t irq;
+	int spi_fd;
+	int irq_fd;
+};
+
+static struct nrf24_io io_radio[] = {
+	{ .dev = "/dev/spidev0.0", .ce = 25, .irq = 24,
+					.spi_fd = -1, .irq_fd = -1 },
+	{ .dev = "/dev/spidev0.1", .ce = 22, .irq = 27,
+					.spi_fd = -1, .irq_fd = -1 },
+};
+
+#define IO_RADIO_COUNTER	((int) (sizeof(io_radio) \
+				 / sizeof(io_radio[0])))
+
+/* Radios sharing the GPIO module */
+static int io_ref = 0;
+
+static struct nrf24_io *io_get(int spi_fd)
+{
+	int i;
+
+	for (i = 0; i < IO_RADIO_COUNTER; i++) {
+		if (io_radio[i].spi_fd == spi_fd)
+			return &io_radio[i];
+	}
+
+	/* Not set up by io_setup(): no wiring */
+	return NULL;
+}
+
+/* Settling times are tens of us: usleep() would overshoot them */
 void delay_us(float us)
 {
-	usleep(us);
+	hal_delay_us(us);
 }
 
-void enable(void)
+void enable(int spi_fd)
 {
-	hal_gpio_digital_write(CE, HAL_GPIO_HIGH);
-	usleep(TPECE2CSN);
+	struct nrf24_io *io = io_get(spi_fd);
+
+	if (io == NULL)
+		return;
+
+	hal_gpio_digital_write(io->ce, HAL_GPIO_HIGH);
+	hal_delay_us(TPECE2CSN);
 }
 
-void disable(void)
+void disable(int spi_fd)
 {
-	hal_gpio_digital_write(CE, HAL_GPIO_LOW);
+	struct nrf24_io *io = io_get(spi_fd);
+
+	if (io == NULL)
+		return;
+
+	hal_gpio_digital_write(io->ce, HAL_GPIO_LOW);
 }
 
 int io_setup(const char *dev)
 {
-	int err;
+	struct nrf24_io *io = NULL;
+	int err, i;
+
+	for (i = 0; i < IO_RADIO_COUNTER; i++) {
+		if (strcmp(dev, io_radio[i].dev) == 0)
+			io = &io_radio[i];
+	}
+
+	/* No wiring known for this device */
+	if (io == NULL)
+		return -ENODEV;
+
+	if (io_ref++ == 0)
+		hal_gpio_setup();
+
+	err = hal_gpio_pin_mode(io->ce, HAL_GPIO_OUTPUT);
+	if (err < 0)
+		goto fail;
+
+	err = hal_gpio_pin_mode(io->irq, HAL_GPIO_INPUT);
+	if (err < 0)
+		goto fail;
 
-	hal_gpio_setup();
+	hal_gpio_digital_write(io->ce, HAL_GPIO_LOW);
 
-	err = hal_gpio_pin_mode(CE, HAL_GPIO_OUTPUT);
+	err = spi_bus_init(dev);
 	if (err < 0)
-		return err;
+		goto fail;
 
-	err = hal_gpio_pin_mode(IRQ, HAL_GPIO_INPUT);
-	if (err < 0){
+	io->spi_fd = err;
+
+	return err;
+
+fail:
+	if (--io_ref == 0)
 		hal_gpio_unmap();
-		return err;
-	}
 
-	disable();
-	return spi_bus_init(dev);
+	return err;
+}
+
+/*
+ * IRQ pin (active low): falling edges are signaled on the fd by the
+ * events of hal_gpio_poll_events(), whichever the GPIO backend.
+ */
+int io_irq_setup(int spi_fd)
+{
+	struct nrf24_io *io = io_get(spi_fd);
+
+	if (io == NULL)
+		return -ENODEV;
+
+	if (io->irq_fd < 0)
+		io->irq_fd = hal_gpio_get_fd(io->irq, HAL_GPIO_FALLING);
+
+	return io->irq_fd;
+}
+
+/*
+ * Consumes the pending IRQ edges: returns 1 if any, 0 otherwise or a
+ * negative error. Without IRQ fd the radio must always be checked.
+ */
+int io_irq_event(int spi_fd)
+{
+	struct nrf24_io *io = io_get(spi_fd);
+	struct hal_gpio_event events[4];
+	int err, ret = 0;
+
+	if (io == NULL)
+		return -ENODEV;
+
+	if (io->irq_fd < 0)
+		return 1;
+
+	do {
+		err = hal_gpio_read_events(io->irq_fd, events,
+					sizeof(events) / sizeof(events[0]));
+		if (err < 0)
+			return err;
+
+		if (err > 0)
+			ret = 1;
+	} while (err == sizeof(events) / sizeof(events[0]));
+
+	return ret;
+}
+
+/*
+ * Sleeps until an IRQ edge or timeout: returns 1 if an edge has been
+ * consumed, 0 on timeout or a negative error.
+ */
+int io_irq_wait(int spi_fd, int timeout_ms)
+{
+	struct nrf24_io *io = io_get(spi_fd);
+	struct pollfd pfd;
+	int err;
+
+	if (io == NULL)
+		return -ENODEV;
+
+	if (io->irq_fd < 0)
+		return 1;
+
+	pfd.fd = io->irq_fd;
+	pfd.events = hal_gpio_poll_events();
+	pfd.revents = 0;
+
+	err = poll(&pfd, 1, timeout_ms);
+	if (err < 0)
+		return -errno;
+
+	if (err == 0)
+		return 0;
+
+	return io_irq_event(spi_fd);
 }
 
 void io_reset(int spi_fd)
 {
-	disable();
-	hal_gpio_unmap();
+	struct nrf24_io *io = io_get(spi_fd);
+
+	if (io == NULL)
+		return;
+
+	disable(spi_fd);
+	io->spi_fd = -1;
+
+	if (io->irq_fd >= 0) {
+		close(io->irq_fd);
+		io->irq_fd = -1;
+	}
+
+	if (io_ref > 0 && --io_ref == 0)
+		hal_gpio_unmap();
+
 	spi_bus_deinit(spi_fd);
 }
@@ -10,6 +10,8 @@
 #include <util/delay.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <SPI.h>
 #include "spi_bus.h"
 
@@ -86,3 +88,87 @@ int spi_bus_transfer(int8_t spi_fd, const uint8_t *tx, int ltx,
 
 	return 0;
 }
+
+void spi_bus_begin(struct spi_bus_batch *batch, int8_t spi_fd)
+{
+	batch->spi_fd = spi_fd;
+	batch->count = 0;
+	batch->ltx = 0;
+}
+
+int spi_bus_append(struct spi_bus_batch *batch, const uint8_t *tx, int ltx,
+			uint8_t *rx, int lrx)
+{
+	int err;
+
+	if (tx == NULL)
+		ltx = 0;
+
+	if (rx == NULL)
+		lrx = 0;
+
+	/* Empty command: there would be no transfer to issue */
+	if (ltx == 0 && lrx == 0)
+		return -EINVAL;
+
+	if (ltx > SPI_BUS_BATCH_TX)
+		return -EINVAL;
+
+	if (batch->count == SPI_BUS_BATCH_MAX ||
+				batch->ltx + ltx > SPI_BUS_BATCH_TX) {
+		err = spi_bus_commit(batch);
+		if (err < 0)
+			return err;
+	}
+
+	memcpy(&batch->tx[batch->ltx], tx, ltx);
+	batch->ltx += ltx;
+	batch->cmd[batch->count].ltx = ltx;
+	batch->cmd[batch->count].rx = rx;
+	batch->cmd[batch->count].lrx = lrx;
+	batch->count++;
+
+	return 0;
+}
+
+int spi_bus_commit(struct spi_bus_batch *batch)
+{
+	const uint8_t *tx = batch->tx;
+	uint8_t i, len;
+	uint8_t *rx;
+
+	if (batch->count == 0)
+		return 0;
+
+	if (!m_init) {
+		batch->count = 0;
+		batch->ltx = 0;
+		return -1;
+	}
+
+	/* Setup communication to device: once for the whole batch */
+	pspi->beginTransaction(SPISettings(SPEED, MSBFIRST, SPI_MODE0));
+
+	for (i = 0; i < batch->count; i++) {
+		/* Put CSN enable */
+		digitalWrite(CSN, LOW);
+
+		for (len = batch->cmd[i].ltx; len != 0; --len)
+			pspi->transfer(*tx++);
+
+		rx = batch->cmd[i].rx;
+		for (len = batch->cmd[i].lrx; len != 0; --len, ++rx)
+			*rx = pspi->transfer(*rx);
+
+		/* Put CSN disable */
+		digitalWrite(CSN, HIGH);
+	}
+
+	/* Finish communication to device */
+	pspi->endTransaction();
+
+	batch->count = 0;
+	batch->ltx = 0;
+
+	return 0;
+}
@@ -11,11 +11,43 @@
 extern "C"{
 #endif
 
+#ifdef ARDUINO
+#define SPI_BUS_BATCH_MAX	4	/* Commands per batch */
+#define SPI_BUS_BATCH_TX	16	/* Command bytes per batch */
+#else
+#define SPI_BUS_BATCH_MAX	12
+#define SPI_BUS_BATCH_TX	48
+#endif
+
+/*
+ * Batched transfers: each appended command is a chip select frame with
+ * the semantics of spi_bus_transfer(). tx bytes are copied, rx must be
+ * valid until spi_bus_commit() issues the whole sequence at once. A
+ * full batch is committed by spi_bus_append(), empty commands (nothing
+ * to send or receive) are rejected.
+ */
+struct spi_bus_batch {
+	int8_t spi_fd;
+	uint8_t count;
+	uint8_t ltx;
+	uint8_t tx[SPI_BUS_BATCH_TX];
+	struct {
+		uint8_t *rx;
+		uint8_t lrx;
+		uint8_t ltx;
+	} cmd[SPI_BUS_BATCH_MAX];
+};
+
 int8_t spi_bus_init(const char *dev);
 int spi_bus_transfer(int8_t spi_fd, const uint8_t *tx, int ltx, uint8_t *rx,
 			int lrx);
 void spi_bus_deinit(int8_t spi_fd);
 
+void spi_bus_begin(struct spi_bus_batch *batch, int8_t spi_fd);
+int spi_bus_append(struct spi_bus_batch *batch, const uint8_t *tx, int ltx,
+			uint8_t *rx, int lrx);
+int spi_bus_commit(struct spi_bus_batch *batch);
+
 #ifdef __cplusplus
 }
 #endif
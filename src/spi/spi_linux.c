@@ -25,11 +25,16 @@
 
 static uint8_t *pdummy;
 static int pdummy_len;
+/* Dummy buffer is shared by all opened SPI devices */
+static int pdummy_ref = 0;
 
 static uint32_t speed = 10000000; /* 10 MHz */
 
 int8_t spi_bus_init(const char *dev)
 {
+	uint8_t mode = SPI_MODE_0,
+		bits = BITS_PER_WORD,
+		lsbfirst = MSBFIRST;
 	int spi_fd;
 
 	spi_fd = open(dev, O_RDWR);
@@ -37,18 +42,26 @@ int8_t spi_bus_init(const char *dev)
 	if (spi_fd < 1)
 		return -errno;
 
+	/* Bus setup is kept by spidev: applied once */
+	ioctl(spi_fd, SPI_IOC_WR_MODE, &mode);
+	ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+	ioctl(spi_fd, SPI_IOC_WR_LSB_FIRST, &lsbfirst);
 	ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
 	if (ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0) {
 		close(spi_fd);
 		return -errno;
 	}
 
-	pdummy = (uint8_t *) malloc(sizeof(uint8_t));
 	if (pdummy == NULL) {
-		close(spi_fd);
-		return -ENOMEM;
+		pdummy = (uint8_t *) malloc(sizeof(uint8_t));
+		if (pdummy == NULL) {
+			close(spi_fd);
+			return -ENOMEM;
+		}
+		pdummy_len = 1;
 	}
-	pdummy_len = 1;
+
+	++pdummy_ref;
 
 	return spi_fd;
 }
@@ -59,7 +72,11 @@ void spi_bus_deinit(int8_t spi_fd)
 		close(spi_fd);
 	}
 
+	if (pdummy_ref > 0 && --pdummy_ref > 0)
+		return;
+
 	free(pdummy);
+	pdummy = NULL;
 	pdummy_len = 0;
 }
 
@@ -86,11 +103,8 @@ int spi_bus_transfer(int8_t spi_fd, const uint8_t *tx, int ltx, uint8_t *rx,
 {
 	struct spi_ioc_transfer data_ioc[2],
 				*pdata_ioc = data_ioc;
-	uint8_t mode = SPI_MODE_0,
-		bits = BITS_PER_WORD,
-		lsbfirst = MSBFIRST;
 	int ntransfer = 0;
-	unsigned int ret;
+	int ret;
 
 	if (spi_fd < 0)
 		return -EIO;
@@ -136,12 +150,103 @@ int spi_bus_transfer(int8_t spi_fd, const uint8_t *tx, int ltx, uint8_t *rx,
 		++ntransfer;
 	}
 
-	ioctl(spi_fd, SPI_IOC_WR_MODE, &mode);
-	ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-	ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-	ioctl(spi_fd, SPI_IOC_WR_LSB_FIRST, &lsbfirst);
-
 	ret = ioctl(spi_fd, SPI_IOC_MESSAGE(ntransfer), data_ioc);
 
-	return ret ? -errno : 0;
+	return ret < 0 ? -errno : 0;
+}
+
+void spi_bus_begin(struct spi_bus_batch *batch, int8_t spi_fd)
+{
+	batch->spi_fd = spi_fd;
+	batch->count = 0;
+	batch->ltx = 0;
+}
+
+int spi_bus_append(struct spi_bus_batch *batch, const uint8_t *tx, int ltx,
+			uint8_t *rx, int lrx)
+{
+	int err;
+
+	if (tx == NULL)
+		ltx = 0;
+
+	if (rx == NULL)
+		lrx = 0;
+
+	/* Empty command: there would be no transfer to issue */
+	if (ltx == 0 && lrx == 0)
+		return -EINVAL;
+
+	if (ltx > SPI_BUS_BATCH_TX)
+		return -EINVAL;
+
+	if (batch->count == SPI_BUS_BATCH_MAX ||
+				batch->ltx + ltx > SPI_BUS_BATCH_TX) {
+		err = spi_bus_commit(batch);
+		if (err < 0)
+			return err;
+	}
+
+	memcpy(&batch->tx[batch->ltx], tx, ltx);
+	batch->ltx += ltx;
+	batch->cmd[batch->count].ltx = ltx;
+	batch->cmd[batch->count].rx = rx;
+	batch->cmd[batch->count].lrx = lrx;
+	batch->count++;
+
+	return 0;
+}
+
+/*
+ * Issues the queued commands as a single SPI message: chip select
+ * is toggled (cs_change) between commands.
+ */
+int spi_bus_commit(struct spi_bus_batch *batch)
+{
+	struct spi_ioc_transfer data_ioc[SPI_BUS_BATCH_MAX * 2];
+	int ntransfer = 0;
+	uint8_t i, offset = 0;
+	int ret;
+
+	if (batch->count == 0)
+		return 0;
+
+	memset(data_ioc, 0, sizeof(data_ioc));
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->cmd[i].ltx != 0) {
+			/* rx_buf NULL: incoming bytes are discarded */
+			data_ioc[ntransfer].tx_buf =
+					(unsigned long) &batch->tx[offset];
+			data_ioc[ntransfer].len = batch->cmd[i].ltx;
+			offset += batch->cmd[i].ltx;
+			ntransfer++;
+		}
+
+		if (batch->cmd[i].lrx != 0) {
+			data_ioc[ntransfer].tx_buf =
+					(unsigned long) batch->cmd[i].rx;
+			data_ioc[ntransfer].rx_buf =
+					(unsigned long) batch->cmd[i].rx;
+			data_ioc[ntransfer].len = batch->cmd[i].lrx;
+			ntransfer++;
+		}
+
+		/* End of command: release chip select */
+		if (ntransfer != 0)
+			data_ioc[ntransfer - 1].cs_change = 1;
+	}
+
+	/* Last transfer: cs_change would keep the chip selected */
+	data_ioc[ntransfer - 1].cs_change = 0;
+
+	batch->count = 0;
+	batch->ltx = 0;
+
+	if (batch->spi_fd < 0)
+		return -EIO;
+
+	ret = ioctl(batch->spi_fd, SPI_IOC_MESSAGE(ntransfer), data_ioc);
+
+	return ret < 0 ? -errno : 0;
 }
@@ -20,6 +20,7 @@
 #include "nrf24l01_io.h"
 #include "hal/nrf24.h"
 #include "hal/time.h"
+#include "hal/gpio_sysfs.h"
 
 #define MESSAGE "This is a test message"
 #define MESSAGE_SIZE sizeof(MESSAGE)
@@ -32,6 +33,7 @@
 #define DEV				"/dev/spidev0.0"
 
 static char *opt_mode = "server";
+static char *opt_gpiomem = NULL;
 static bool aack, server; //auto-ack and server/client flags
 static int8_t pipe, rx_len, tx_len, tx_status, tx_pipe;
 static int32_t tx_stamp, attempt;
@@ -67,6 +69,8 @@ static GOptionEntry options[] = {
 		"mode", "Operation mode: server or client" },
 	{ "ack", 'a', 0, G_OPTION_ARG_INT, &aack,
 		"ack", "Connection channel: broadcast or data(auto-ack)" },
+	{ "gpiomem", 'g', 0, G_OPTION_ARG_STRING, &opt_gpiomem,
+		"gpiomem", "GPIO registers to map: /dev/gpiomem" },
 	{ NULL },
 };
 
@@ -248,6 +252,11 @@ int main(int argc, char *argv[])
 
 	/* Initialize Radio */
 	spi_fd = io_setup(DEV);
+
+	/* CE toggled by register stores: falls back to the GPIO backend */
+	if (opt_gpiomem && hal_gpio_mmap(opt_gpiomem) < 0)
+		printf("GPIO registers not mapped: %s\n", opt_gpiomem);
+
 	nrf24l01_init(DEV, NRF24_PWR_0DBM);
 	nrf24l01_set_standby(spi_fd);
 
@@ -51,6 +51,7 @@ static inline void decode_raw(unsigned long sec, unsigned long usec,
 				(const struct nrf24_ll_data_pdu *) payload;
 	const struct nrf24_ll_crtl_pdu *ctrl;
 	const struct nrf24_ll_keepalive *kpalive;
+	const struct nrf24_ll_nack *nack;
 	char src[32], dst[32];
 	int i;
 
@@ -62,7 +63,14 @@ static inline void decode_raw(unsigned long sec, unsigned long usec,
 		nrf24_mac2str(&kpalive->src_addr, src);
 		nrf24_mac2str(&kpalive->dst_addr, dst);
 
-		if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_REQ) {
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_NACK) {
+			nack = (struct nrf24_ll_nack *) ctrl->payload;
+			printf("%05ld.%06ld nRF24: CRTL | NACK (0x%02x) " \
+						"plen:%zd\n", sec, usec,
+						ctrl->opcode, plen);
+			printf("  MSG:0x%02x missing:0x%016" PRIx64 "\n",
+						nack->msgid, nack->missing);
+		} else if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_REQ) {
 			printf("%05ld.%06ld nRF24: CRTL | Keep Alive Req " \
 						"(0x%02x) plen:%zd\n", sec,
 						usec, ctrl->opcode, plen);
@@ -76,8 +84,9 @@ static inline void decode_raw(unsigned long sec, unsigned long usec,
 		break;
 	case NRF24_PDU_LID_DATA_FRAG:
 	case NRF24_PDU_LID_DATA_END:
-		printf("%05ld.%06ld  nRF24: Data | SEQ:0x%02x plen:%zd\n",
-					sec, usec, ipdu->nseq, plen);
+		printf("%05ld.%06ld  nRF24: Data | MSG:0x%02x SEQ:0x%02x " \
+					"plen:%zd\n", sec, usec, ipdu->msgid,
+					ipdu->nseq, plen);
 		printf("  ");
 		for (i = 0; i < plen; i++)
 			printf("%02x", payload[i]);